@@ -0,0 +1,74 @@
+#ifndef FRUIT_PROTO_H
+#define FRUIT_PROTO_H
+
+// Binary framed protocol for the TCP fruit store.
+//
+// A client opts in by sending PROTO_MAGIC instead of its customer ID as the
+// first 4 bytes. After that both directions are a stream of frames:
+//
+//   u32 len (network order, counts type + payload) | u8 type | payload
+//
+// Requests may be pipelined: the server answers every complete frame it has
+// in the order received and sends the replies of one read as one batch.
+//
+//   FT_HELLO   i32 customer id               (first frame)
+//   FT_STOCK   -                             -> FT_STOCK_REPLY  text
+//   FT_BUY     i32 qty | u8 n | name[n]      -> FT_RESULT  u8 status | i32 left | text
+//   FT_BYE     -                             -> FT_BYE_REPLY  text, then close
+//   FT_ORDER   u8 lines | lines x (i32 qty | u8 n | name[n])
+//                                            -> FT_RESULT, all lines bought or none
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PROTO_MAGIC 0x46524231u   // "FRB1"
+#define FRAME_HDR 5
+#define FRAME_MAX 65536           // largest type + payload a client may send
+
+enum {
+    FT_HELLO = 1,
+    FT_STOCK,
+    FT_BUY,
+    FT_BYE,
+    FT_ORDER,
+    FT_STOCK_REPLY = 0x81,
+    FT_RESULT,
+    FT_BYE_REPLY,
+    FT_ERROR
+};
+
+enum { RS_OK, RS_REGRET, RS_NOT_FOUND, RS_BAD_REQUEST };
+
+static inline void put_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static inline uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+// Writes the frame header for a payload of plen bytes; the payload follows at dst + FRAME_HDR
+static inline void frame_header(char *dst, uint8_t type, uint32_t plen) {
+    put_u32(dst, plen + 1);
+    dst[4] = (char)type;
+}
+
+// Looks for one complete frame at the start of buf. Returns its total size,
+// 0 if more bytes are needed, or -1 if the length field is invalid.
+static inline long frame_parse(const char *buf, size_t len, uint8_t *type,
+                               const char **payload, uint32_t *plen) {
+    if(len < 4) return 0;
+    uint32_t flen = get_u32(buf);
+    if(flen < 1 || flen > FRAME_MAX) return -1;
+    if(len < 4 + (size_t)flen) return 0;
+    *type = (uint8_t)buf[4];
+    *payload = buf + FRAME_HDR;
+    *plen = flen - 1;
+    return 4 + (long)flen;
+}
+
+#endif
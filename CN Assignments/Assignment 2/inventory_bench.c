@@ -0,0 +1,142 @@
+// Contention benchmark for the fruit inventory purchase path.
+// Compile: gcc -O2 inventory_bench.c ../common/fruit_catalog.c -o inventory_bench -pthread
+// Run: ./inventory_bench [max_threads] [seconds_per_run]
+//
+// Every thread buys 1 unit in a tight loop, either all on "Apple" (hot) or
+// each on its own fruit (spread). The lock-free path is compared against the
+// old scheme of one global mutex around a linear strcasecmp scan.
+// A second table buys baskets of BASKET fruits, as one all-or-nothing
+// buy_order() versus BASKET separate buy_fruit() calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "../common/fruit_catalog.h"
+
+#define STOCK (1 << 30)
+#define EXTRA_SKUS 59   // 64 fruits with the defaults
+#define BASKET 10
+
+typedef struct {
+    int idx;
+    int hot;
+    int locked;
+    int basket;     // 0: single purchases; 1: as orders; 2: as separate buys
+    long ops;
+} Worker;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_int running;
+
+// The pre-atomic purchase path: global lock + linear scan
+int locked_buy(const char *name, int qty) {
+    int ok = 0, n = fruit_count();
+    pthread_mutex_lock(&lock);
+    for(int i = 0; i < n; i++) {
+        Fruit *f = fruit_at(i);
+        if(strcasecmp(f->name, name) == 0) {
+            int cur = atomic_load_explicit(&f->qty, memory_order_relaxed);
+            if(cur >= qty) {
+                atomic_store_explicit(&f->qty, cur - qty, memory_order_relaxed);
+                atomic_store_explicit(&f->last_sold, time(NULL), memory_order_relaxed);
+                ok = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void* worker(void* arg) {
+    Worker *w = arg;
+    const char *name = w->hot ? "Apple" : fruit_at(w->idx % fruit_count())->name;
+    long ops = 0;
+    int left, n, short_line;
+    OrderLine lines[BASKET], order[BASKET];
+
+    for(int k = 0; k < BASKET; k++) {
+        lines[k].fruit = fruit_at((w->idx * BASKET + k) % fruit_count());
+        lines[k].qty = 1;
+    }
+    while(running && w->basket) {
+        if(w->basket == 1) {
+            memcpy(order, lines, sizeof(lines));   // buy_order sorts in place
+            n = BASKET;
+            buy_order(order, &n, &short_line, &left);
+        } else {
+            for(int k = 0; k < BASKET; k++) buy_fruit(lines[k].fruit, 1, &left);
+        }
+        ops++;
+    }
+
+    while(running && !w->basket) {
+        if(w->locked) locked_buy(name, 1);
+        else buy_fruit(find_fruit(name), 1, &left);
+        ops++;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+double run(int nthreads, int hot, int locked, int basket, int secs) {
+    pthread_t tids[nthreads];
+    Worker w[nthreads];
+
+    for(int i = 0; i < fruit_count(); i++) atomic_store(&fruit_at(i)->qty, STOCK);
+
+    running = 1;
+    for(int i = 0; i < nthreads; i++) {
+        w[i].idx = i;
+        w[i].hot = hot;
+        w[i].locked = locked;
+        w[i].basket = basket;
+        w[i].ops = 0;
+        pthread_create(&tids[i], NULL, worker, &w[i]);
+    }
+    sleep(secs);
+    running = 0;
+
+    long total = 0;
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        total += w[i].ops;
+    }
+    return (double)total / secs;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int secs = argc > 2 ? atoi(argv[2]) : 1;
+    if(max_threads < 1) max_threads = 1;
+    if(secs < 1) secs = 1;
+    init_fruits();
+    for(int i = 0; i < EXTRA_SKUS; i++) {
+        char name[20];
+        sprintf(name, "Sku%d", i);
+        add_fruit(name, 0);
+    }
+
+    printf("%-8s %18s %18s %18s %18s\n", "threads",
+           "mutex hot/s", "mutex spread/s", "atomic hot/s", "atomic spread/s");
+    for(int t = 1; ; t = t * 2 < max_threads ? t * 2 : max_threads) {
+        printf("%-8d %18.0f %18.0f %18.0f %18.0f\n", t,
+               run(t, 1, 1, 0, secs), run(t, 0, 1, 0, secs),
+               run(t, 1, 0, 0, secs), run(t, 0, 0, 0, secs));
+        fflush(stdout);
+        if(t == max_threads) break;
+    }
+
+    printf("\nBaskets of %d fruits\n", BASKET);
+    printf("%-8s %18s %18s\n", "threads", "orders/s", "separate buys/s");
+    for(int t = 1; ; t = t * 2 < max_threads ? t * 2 : max_threads) {
+        printf("%-8d %18.0f %18.0f\n", t, run(t, 0, 0, 1, secs), run(t, 0, 0, 2, secs));
+        fflush(stdout);
+        if(t == max_threads) break;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Purchase throughput with the sales log off, on without fsync, and on with
+// group-committed fsync.
+// Compile: gcc -O2 sales_log_bench.c ../common/fruit_catalog.c ../common/stock_snapshot.c ../common/sales_log.c -o sales_log_bench -pthread
+// Run: ./sales_log_bench [max_threads] [seconds_per_run] [state_dir]
+//
+// Every thread buys 1 unit of its own fruit and, like a server thread, waits
+// for the sale to be logged (written, plus fsynced in the last mode) before
+// buying again. Each mode runs in its own
+// process since the log is started once per process. state_dir (default
+// ./sales_bench_state) should be on the disk to be measured, not tmpfs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "../common/fruit_catalog.h"
+#include "../common/sales_log.h"
+
+#define STOCK (1 << 30)
+#define EXTRA_SKUS 59   // 64 fruits with the defaults
+
+typedef struct {
+    int idx;
+    long ops;
+} Worker;
+
+atomic_int running;
+
+void* worker(void* arg) {
+    Worker *w = arg;
+    Fruit *f = fruit_at(w->idx % fruit_count());
+    unsigned long lsn;
+    int left;
+    long ops = 0;
+
+    while(running) {
+        if(sales_log_buy(f, 1, &left, &lsn)) sales_log_wait(lsn);
+        ops++;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+double run(int nthreads, int secs) {
+    pthread_t tids[nthreads];
+    Worker w[nthreads];
+
+    running = 1;
+    for(int i = 0; i < nthreads; i++) {
+        w[i].idx = i;
+        w[i].ops = 0;
+        pthread_create(&tids[i], NULL, worker, &w[i]);
+    }
+    sleep(secs);
+    running = 0;
+
+    long total = 0;
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        total += w[i].ops;
+    }
+    return (double)total / secs;
+}
+
+int next_threads(int t, int max) {
+    return t * 2 < max ? t * 2 : max;
+}
+
+// Child process: one column of the table, written to fd as doubles
+void run_mode(int mode, int max_threads, int secs, const char *dir, int fd) {
+    init_fruits();
+    for(int i = 0; i < EXTRA_SKUS; i++) {
+        char name[20];
+        sprintf(name, "Sku%d", i);
+        add_fruit(name, 0);
+    }
+    for(int i = 0; i < fruit_count(); i++) atomic_store(&fruit_at(i)->qty, STOCK);
+    if(mode > 0 && sales_log_start(dir, mode == 2) < 0) {
+        perror("Sales log start failed");
+        exit(1);
+    }
+
+    for(int t = 1; ; t = next_threads(t, max_threads)) {
+        double r = run(t, secs);
+        if(write(fd, &r, sizeof(r)) != sizeof(r)) exit(1);
+        if(t == max_threads) break;
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    int secs = argc > 2 ? atoi(argv[2]) : 1;
+    const char *dir = argc > 3 ? argv[3] : "sales_bench_state";
+    if(max_threads < 1) max_threads = 1;
+    if(secs < 1) secs = 1;
+
+    int pipes[3][2];
+    for(int mode = 0; mode < 3; mode++) {
+        if(pipe(pipes[mode]) < 0) {
+            perror("Pipe failed");
+            exit(1);
+        }
+        if(fork() == 0) run_mode(mode, max_threads, secs, dir, pipes[mode][1]);
+        close(pipes[mode][1]);
+        wait(NULL);     // one mode at a time, so they don't compete
+    }
+
+    printf("%-8s %18s %18s %18s\n", "threads", "no log/s", "log, no fsync/s", "log + fsync/s");
+    for(int t = 1; ; t = next_threads(t, max_threads)) {
+        double r[3] = {0, 0, 0};
+        for(int mode = 0; mode < 3; mode++)
+            if(read(pipes[mode][0], &r[mode], sizeof(double)) != sizeof(double)) r[mode] = 0;
+        printf("%-8d %18.0f %18.0f %18.0f\n", t, r[0], r[1], r[2]);
+        if(t == max_threads) break;
+    }
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/fruits.snap", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/fruits.wal", dir);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -1,14 +1,129 @@
+// Compile: gcc tcp_fruit_store_client.c -o client2
+// Run: ./client2 [-b]
+//   -b - binary framed protocol: a whole basket is pipelined in one write
+// Prefix a basket with "order " to buy all of it or nothing.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "fruit_proto.h"
 
 #define PORT 8080
 #define MAX 1024
+#define MAX_ITEMS 64
+#define MAX_ORDER_LINES 20
+
+char in[4 + FRAME_MAX];
+size_t in_len = 0;
+
+// Blocks until one whole frame has arrived; returns its payload (valid until the next call)
+const char* read_frame(int sock, uint8_t *type, uint32_t *plen) {
+    static size_t used = 0;
+    memmove(in, in + used, in_len - used);
+    in_len -= used;
+    used = 0;
+
+    while(1) {
+        const char *payload;
+        long n = frame_parse(in, in_len, type, &payload, plen);
+        if(n < 0) return NULL;
+        if(n > 0) {
+            used = n;
+            return payload;
+        }
+        ssize_t r = recv(sock, in + in_len, sizeof(in) - in_len, 0);
+        if(r <= 0) return NULL;
+        in_len += r;
+    }
+}
+
+int send_frames(int sock, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t s = send(sock, buf, len, 0);
+        if(s <= 0) return -1;
+        buf += s;
+        len -= s;
+    }
+    return 0;
+}
+
+void run_binary(int sock, int id) {
+    char out[MAX_ITEMS * (FRAME_HDR + 5 + 50) + 16];
+    size_t len;
+    uint8_t type;
+    uint32_t plen;
+    const char *p;
+
+    put_u32(out, PROTO_MAGIC);
+    frame_header(out + 4, FT_HELLO, 4);
+    put_u32(out + 4 + FRAME_HDR, (uint32_t)id);
+    send_frames(sock, out, 4 + FRAME_HDR + 4);
+
+    while(1) {
+        frame_header(out, FT_STOCK, 0);
+        if(send_frames(sock, out, FRAME_HDR) < 0) break;
+        if(!(p = read_frame(sock, &type, &plen)) || type != FT_STOCK_REPLY) break;
+        printf("%.*s", (int)plen, p);
 
-int main() {
+        printf("\nEnter 'fruit qty [fruit qty ...]', 'order fruit qty ...' or 'exit': ");
+        fflush(stdout);
+        char line[MAX];
+        if(!fgets(line, MAX, stdin)) break;
+        line[strcspn(line, "\n")] = 0;
+
+        if(strcmp(line, "exit") == 0) {
+            frame_header(out, FT_BYE, 0);
+            send_frames(sock, out, FRAME_HDR);
+            if((p = read_frame(sock, &type, &plen))) printf("%.*s", (int)plen, p);
+            return;
+        }
+
+        // One FT_BUY frame per item, all sent in a single write; or all
+        // items as the lines of one FT_ORDER frame
+        int order = strncmp(line, "order ", 6) == 0;
+        int items = 0;
+        len = order ? FRAME_HDR + 1 : 0;
+        char *tok = strtok(order ? line + 6 : line, " ");
+        while(tok && items < (order ? MAX_ORDER_LINES : MAX_ITEMS)) {
+            char *qty = strtok(NULL, " ");
+            if(!qty) break;
+            size_t n = strlen(tok);
+            if(n >= 50) n = 49;
+            if(!order) {
+                frame_header(out + len, FT_BUY, 5 + n);
+                len += FRAME_HDR;
+            }
+            put_u32(out + len, (uint32_t)atoi(qty));
+            out[len + 4] = (char)n;
+            memcpy(out + len + 5, tok, n);
+            len += 5 + n;
+            items++;
+            tok = strtok(NULL, " ");
+        }
+        if(order) {
+            frame_header(out, FT_ORDER, len - FRAME_HDR);
+            out[FRAME_HDR] = (char)items;
+            items = 1;
+        }
+        if(send_frames(sock, out, len) < 0) break;
+
+        for(int i = 0; i < items; i++) {
+            if(!(p = read_frame(sock, &type, &plen)) || type != FT_RESULT || plen < 5) {
+                printf("\nServer disconnected\n");
+                return;
+            }
+            printf("%.*s", (int)plen - 5, p + 5);
+        }
+        fflush(stdout);
+    }
+    printf("\nServer disconnected\n");
+}
+
+int main(int argc, char *argv[]) {
     int sock;
+    int binary = argc > 1 && strcmp(argv[1], "-b") == 0;
     struct sockaddr_in addr;
     char buf[MAX], ip[20];
     int id;
@@ -56,9 +171,16 @@ int main() {
     scanf("%d", &id);
     getchar();
     
-    send(sock, &id, sizeof(int), 0);
     printf("\n*** Welcome Customer #%d ***\n", id);
     fflush(stdout);
+
+    if(binary) {
+        run_binary(sock, id);
+        close(sock);
+        printf("\nDisconnected from server\n");
+        return 0;
+    }
+    send(sock, &id, sizeof(int), 0);
     
     while(1) {
         memset(buf, 0, MAX);
@@ -1,41 +1,315 @@
+// Compile: gcc tcp_fruit_store_server.c ../common/fruit_catalog.c ../common/stock_snapshot.c ../common/customer_registry.c ../common/sales_log.c -o server2 -pthread
+// Run: ./server2 [-m thread|epoll] [-l event_loops] [-c catalog_file] [-d state_dir [-a]]
+//   -m thread - one detached thread per customer (default)
+//   -m epoll  - small fixed pool of epoll event loops, one state machine per customer
+//   -c file   - load the catalog ("name qty" per line) instead of the default fruits
+//   -d dir    - keep stock across restarts: log every sale to dir and restore
+//               from it at startup (the catalog only seeds an empty dir).
+//               A purchase is confirmed once its log record is fsynced;
+//               event loops hold the reply instead of waiting for the disk.
+//   -a        - with -d, skip the fsync: confirm once the record is written
+//               (survives a server crash, not an OS crash)
+// At the fruit name prompt, "order Apple 2 Banana 3" buys a whole basket or nothing.
+// Clients speak either the text dialogue or, if they open with PROTO_MAGIC,
+// the pipelined binary protocol in fruit_proto.h. Both work in both modes.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "fruit_proto.h"
+#include "../common/fruit_catalog.h"
+#include "../common/stock_snapshot.h"
+#include "../common/customer_registry.h"
+#include "../common/sales_log.h"
 
 #define PORT 8080
 #define MAX 1024
+#define DEFAULT_LOOPS 4
+#define MAX_EVENTS 256
+#define IN_CAP (4 + FRAME_MAX)   // binary input buffer: always fits one whole frame
+#define OUT_PAUSE (256 * 1024)   // stop reading a client while this much output is unsent
+
+const char prompt[] = "\nEnter fruit name (or 'exit'): ";
+
+Customer *add_client(int id) {
+    int is_new;
+    Customer *c = customer_get(id, &is_new);
+    if(is_new) snapshot_touch();
+    return c;
+}
+
+// Stock + customer list, as sent at the top of every round (text clients
+// get the name prompt after it). Only runs when a purchase or a new customer has made the snapshot stale.
+void render_stock(TextBuf *tb) {
+    tb_printf(tb, "\n=== Current Stock ===\n");
+    int n = fruit_count();
+    for(int i = 0; i < n; i++) {
+        Fruit *f = fruit_at(i);
+        char last[30];
+        fruit_last_sold(f, last, sizeof(last));
+        tb_printf(tb, "%d. %s: Qty=%d, Last=%s\n", i+1, f->name, atomic_load(&f->qty), last);
+    }
+
+    int total = customer_count();
+    tb_printf(tb, "\n=== Customer List ===\n");
+    for(int i = 0; i < total && i < CUSTOMER_LIST_MAX; i++) {
+        Customer *c = customer_listed(i);
+        if(c) tb_printf(tb, "Customer ID: %d (%ld purchases)\n", c->id, atomic_load(&c->purchases));
+    }
+    if(total > CUSTOMER_LIST_MAX) tb_printf(tb, "... and %d more\n", total - CUSTOMER_LIST_MAX);
+    tb_printf(tb, "Total Customers: %d\n", total);
+}
+
+// Apply one purchase and write the SUCCESS/REGRET/ERROR reply into buf.
+// Returns an RS_* status; *left is the stock remaining (or seen, on REGRET).
+// *lsn is the sales log record the reply must wait for, or 0.
+// Lock-free: buyers of different fruits never touch the same cache line.
+int purchase(Customer *cust, const char *fname, int qty, char *buf, int *left, unsigned long *lsn) {
+    int id = cust->id;
+    Fruit *f = find_fruit(fname);
+    *left = 0;
+    *lsn = 0;
+    if(!f) {
+        sprintf(buf, "\n✗ ERROR: Fruit '%s' not found\n", fname);
+        return RS_NOT_FOUND;
+    }
+    if(qty <= 0) {
+        sprintf(buf, "\n✗ ERROR: Quantity must be positive\n");
+        return RS_BAD_REQUEST;
+    }
+    int status;
+    if(sales_log_buy(f, qty, left, lsn)) {
+        customer_purchased(cust);
+        snapshot_touch();
+        sprintf(buf, "\n✓ SUCCESS: Purchased %d %s(s)\n", qty, fname);
+        printf("Client %d purchased %d %s\n", id, qty, fname);
+        status = RS_OK;
+    } else {
+        sprintf(buf, "\n✗ REGRET: Only %d %s available (requested %d)\n", *left, fname, qty);
+        printf("Client %d: Insufficient stock for %s\n", id, fname);
+        status = RS_REGRET;
+    }
+    fflush(stdout);
+    return status;
+}
+
+// Apply a basket as one all-or-nothing order and write the reply into buf
+int place_order(Customer *cust, OrderLine *lines, int n, char *buf, int *left, unsigned long *lsn) {
+    int short_line;
+    if(!sales_log_order(lines, &n, &short_line, left, lsn)) {
+        sprintf(buf, "\n✗ REGRET: Order cancelled, only %d %s available (requested %d)\n",
+                *left, lines[short_line].fruit->name, lines[short_line].qty);
+        printf("Client %d: Order cancelled, insufficient stock for %s\n", cust->id, lines[short_line].fruit->name);
+        fflush(stdout);
+        return RS_REGRET;
+    }
+
+    // buf holds at least MAX - 5 bytes (binary replies prefix status + left)
+    int len = sprintf(buf, "\n✓ SUCCESS: Ordered");
+    for(int i = 0; i < n; i++) {
+        if(len < MAX - 80)
+            len += sprintf(buf + len, "%s %d %s", i ? "," : "", lines[i].qty, lines[i].fruit->name);
+        customer_purchased(cust);
+    }
+    strcpy(buf + len, "\n");
+    snapshot_touch();
+    printf("Client %d ordered %d item(s)\n", cust->id, n);
+    fflush(stdout);
+    return RS_OK;
+}
 
-typedef struct {
+// Text form of an order: "Apple 2 Banana 3 ..."
+int order_from_text(Customer *cust, const char *args, char *buf, unsigned long *lsn) {
+    OrderLine lines[MAX_ORDER_LINES];
     char name[50];
-    int qty;
-    char last_sold[30];
-} Fruit;
+    int n = 0, qty, used, left;
 
-Fruit fruits[10];
-int fruit_cnt = 0;
-int clients[100], client_cnt = 0;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    *lsn = 0;
+    while(sscanf(args, "%49s %d%n", name, &qty, &used) == 2) {
+        if(n == MAX_ORDER_LINES || qty <= 0) {
+            sprintf(buf, "\n✗ ERROR: Orders take 1-%d lines with positive quantities\n", MAX_ORDER_LINES);
+            return RS_BAD_REQUEST;
+        }
+        if(!(lines[n].fruit = find_fruit(name))) {
+            sprintf(buf, "\n✗ ERROR: Fruit '%s' not found\n", name);
+            return RS_NOT_FOUND;
+        }
+        lines[n++].qty = qty;
+        args += used;
+    }
+    if(n == 0) {
+        sprintf(buf, "\n✗ ERROR: Usage: order <fruit> <qty> [<fruit> <qty> ...]\n");
+        return RS_BAD_REQUEST;
+    }
+    return place_order(cust, lines, n, buf, &left, lsn);
+}
+
+/* ---------- binary framed protocol ---------- */
+
+int frame_out(TextBuf *out, uint8_t type, const void *payload, uint32_t plen) {
+    char hdr[FRAME_HDR];
+    frame_header(hdr, type, plen);
+    if(tb_append(out, hdr, FRAME_HDR) < 0) return -1;
+    return tb_append(out, payload, plen);
+}
+
+// FT_ORDER payload: u8 lines, then per line i32 qty | u8 n | name[n]
+int order_from_frame(Customer *cust, const char *p, uint32_t plen, char *buf, int *left, unsigned long *lsn) {
+    OrderLine lines[MAX_ORDER_LINES];
+    uint8_t n = plen ? (uint8_t)p[0] : 0;
+    uint32_t off = 1;
+    char name[50];
+
+    *left = 0;
+    *lsn = 0;
+    if(n == 0 || n > MAX_ORDER_LINES) {
+        sprintf(buf, "\n✗ ERROR: Orders take 1-%d lines\n", MAX_ORDER_LINES);
+        return RS_BAD_REQUEST;
+    }
+    for(int i = 0; i < n; i++) {
+        if(off + 5 > plen) goto bad;
+        int qty = (int)get_u32(p + off);
+        uint8_t nlen = (uint8_t)p[off + 4];
+        off += 5;
+        if(qty <= 0 || nlen >= sizeof(name) || off + nlen > plen) goto bad;
+        memcpy(name, p + off, nlen);
+        name[nlen] = 0;
+        off += nlen;
+        if(!(lines[i].fruit = find_fruit(name))) {
+            sprintf(buf, "\n✗ ERROR: Fruit '%s' not found\n", name);
+            return RS_NOT_FOUND;
+        }
+        lines[i].qty = qty;
+    }
+    if(off != plen) goto bad;
+    return place_order(cust, lines, n, buf, left, lsn);
+
+bad:
+    strcpy(buf, "\n✗ ERROR: Malformed order\n");
+    return RS_BAD_REQUEST;
+}
+
+// Answers every complete frame at the start of in, appending the replies to
+// out in order. Returns the bytes consumed (a trailing partial frame is left
+// for the next read), or -1 if the connection must be dropped. *closing is
+// set once FT_BYE has been answered. *lsn is the last sales log record the
+// replies depend on, so the caller waits once for the whole batch.
+long handle_frames(Customer **cust, const char *in, size_t len, TextBuf *out, int *closing, unsigned long *lsn) {
+    size_t off = 0;
+    unsigned long rec;
+    *lsn = 0;
+    while(!*closing) {
+        uint8_t type;
+        const char *p;
+        uint32_t plen;
+        long n = frame_parse(in + off, len - off, &type, &p, &plen);
+        if(n < 0) return -1;
+        if(n == 0) break;
+        off += n;
+
+        if(type == FT_HELLO && !*cust && plen == 4) {
+            int id = (int)get_u32(p);
+            if(!(*cust = add_client(id))) return -1;
+            printf("Client %d connected (binary)\n", id);
+            fflush(stdout);
+            continue;
+        }
+        if(!*cust) {
+            frame_out(out, FT_ERROR, "HELLO expected", 14);
+            return -1;
+        }
+
+        if(type == FT_STOCK) {
+            const StockSnapshot *snap = snapshot_acquire();
+            int r = frame_out(out, FT_STOCK_REPLY, snap->text, snap->len);
+            snapshot_release(snap);
+            if(r < 0) return -1;
+        } else if(type == FT_BUY) {
+            char res[200], fname[50];
+            int left = 0, status = RS_BAD_REQUEST;
+            uint8_t nlen = plen >= 5 ? (uint8_t)p[4] : 0;
+            if(plen >= 5 && nlen < sizeof(fname) && plen == 5u + nlen) {
+                memcpy(fname, p + 5, nlen);
+                fname[nlen] = 0;
+                status = purchase(*cust, fname, (int)get_u32(p), res + 5, &left, &rec);
+                if(rec > *lsn) *lsn = rec;
+            } else {
+                strcpy(res + 5, "\n✗ ERROR: Malformed purchase\n");
+            }
+            res[0] = (char)status;
+            put_u32(res + 1, (uint32_t)left);
+            if(frame_out(out, FT_RESULT, res, 5 + strlen(res + 5)) < 0) return -1;
+        } else if(type == FT_ORDER) {
+            char res[MAX];
+            int left = 0, status = order_from_frame(*cust, p, plen, res + 5, &left, &rec);
+            if(rec > *lsn) *lsn = rec;
+            res[0] = (char)status;
+            put_u32(res + 1, (uint32_t)left);
+            if(frame_out(out, FT_RESULT, res, 5 + strlen(res + 5)) < 0) return -1;
+        } else if(type == FT_BYE) {
+            frame_out(out, FT_BYE_REPLY, "Thank you! Goodbye.\n", 20);
+            *closing = 1;
+        } else {
+            frame_out(out, FT_ERROR, "unknown frame", 13);
+            return -1;
+        }
+    }
+    return off;
+}
 
-void init_fruits() {
-    strcpy(fruits[0].name, "Apple"); fruits[0].qty = 100;
-    strcpy(fruits[1].name, "Banana"); fruits[1].qty = 150;
-    strcpy(fruits[2].name, "Orange"); fruits[2].qty = 80;
-    strcpy(fruits[3].name, "Mango"); fruits[3].qty = 60;
-    strcpy(fruits[4].name, "Grapes"); fruits[4].qty = 120;
-    fruit_cnt = 5;
-    for(int i = 0; i < 5; i++) strcpy(fruits[i].last_sold, "Never");
+int send_all(int sock, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t s = send(sock, data, len, MSG_NOSIGNAL);
+        if(s < 0 && errno == EINTR) continue;
+        if(s <= 0) return -1;
+        data += s;
+        len -= s;
+    }
+    return 0;
 }
 
-void add_client(int id) {
-    pthread_mutex_lock(&lock);
-    for(int i = 0; i < client_cnt; i++)
-        if(clients[i] == id) { pthread_mutex_unlock(&lock); return; }
-    clients[client_cnt++] = id;
-    pthread_mutex_unlock(&lock);
+// Thread-per-client loop for a binary client: every read is parsed for as
+// many frames as it completed and all their replies go out in one send.
+void serve_binary(int sock) {
+    char *in = malloc(IN_CAP);
+    size_t in_len = 0;
+    TextBuf out = {0};
+    Customer *cust = NULL;
+    int closing = 0;
+    unsigned long lsn;
+
+    while(in && !closing) {
+        ssize_t r = recv(sock, in + in_len, IN_CAP - in_len, 0);
+        if(r <= 0) break;
+        in_len += r;
+
+        out.len = 0;
+        long used = handle_frames(&cust, in, in_len, &out, &closing, &lsn);
+        sales_log_wait(lsn);
+        if(cust) customer_seen(cust, r + out.len);
+        if(out.len && send_all(sock, out.data, out.len) < 0) break;
+        if(used < 0) break;
+        memmove(in, in + used, in_len - used);
+        in_len -= used;
+    }
+
+    if(cust) {
+        printf("Client %d disconnected\n", cust->id);
+        fflush(stdout);
+    }
+    free(in);
+    free(out.data);
 }
 
 void* handle_client(void* arg) {
@@ -43,132 +317,502 @@ void* handle_client(void* arg) {
     free(arg);
     char buf[MAX];
     int id;
-    
-    int bytes = recv(sock, &id, sizeof(int), 0);
-    if(bytes <= 0) {
+    unsigned long lsn;
+
+    int bytes = recv(sock, &id, sizeof(int), MSG_WAITALL);
+    if(bytes < (int)sizeof(int)) {
+        close(sock);
+        return NULL;
+    }
+    if(get_u32((char*)&id) == PROTO_MAGIC) {
+        serve_binary(sock);
         close(sock);
         return NULL;
     }
-    
+
     printf("Client %d connected\n", id);
     fflush(stdout);
-    add_client(id);
-    
+    Customer *cust = add_client(id);
+    if(!cust) {
+        close(sock);
+        return NULL;
+    }
+
     while(1) {
-        memset(buf, 0, MAX);
-        
-        // Send stock
-        sprintf(buf, "\n=== Current Stock ===\n");
-        for(int i = 0; i < fruit_cnt; i++) {
-            char tmp[200];
-            sprintf(tmp, "%d. %s: Qty=%d, Last=%s\n", i+1, fruits[i].name, fruits[i].qty, fruits[i].last_sold);
-            strcat(buf, tmp);
-        }
-        
-        // Send client list
-        pthread_mutex_lock(&lock);
-        strcat(buf, "\n=== Customer List ===\n");
-        for(int i = 0; i < client_cnt; i++) {
-            char tmp[50];
-            sprintf(tmp, "Customer ID: %d\n", clients[i]);
-            strcat(buf, tmp);
-        }
-        sprintf(buf + strlen(buf), "Total Customers: %d\n", client_cnt);
-        pthread_mutex_unlock(&lock);
-        
-        strcat(buf, "\nEnter fruit name (or 'exit'): ");
-        send(sock, buf, strlen(buf), 0);
-        
+        long io = 0;   // bytes exchanged this round
+        const StockSnapshot *snap = snapshot_acquire();
+        struct iovec iov[2] = {
+            { (void*)snap->text, snap->len },
+            { (void*)prompt, sizeof(prompt) - 1 }
+        };
+        writev(sock, iov, 2);
+        io += snap->len + sizeof(prompt) - 1;
+        snapshot_release(snap);
+
         memset(buf, 0, MAX);
         bytes = recv(sock, buf, MAX, 0);
         if(bytes <= 0) break;
+        io += bytes;
         buf[strcspn(buf, "\n")] = 0;
-        
+
         if(strcmp(buf, "exit") == 0) {
             strcpy(buf, "Thank you! Goodbye.\n");
             send(sock, buf, strlen(buf), 0);
+            customer_seen(cust, io + strlen(buf));
             break;
         }
-        
+
+        if(strncasecmp(buf, "order ", 6) == 0) {
+            char args[MAX];
+            strcpy(args, buf + 6);
+            order_from_text(cust, args, buf, &lsn);
+            sales_log_wait(lsn);
+            send(sock, buf, strlen(buf), 0);
+            customer_seen(cust, io + strlen(buf));
+            continue;
+        }
+
         char fname[50];
         strcpy(fname, buf);
-        
+
         strcpy(buf, "Enter quantity: ");
         send(sock, buf, strlen(buf), 0);
-        
+        io += strlen(buf);
+
         memset(buf, 0, MAX);
         bytes = recv(sock, buf, MAX, 0);
         if(bytes <= 0) break;
+        io += bytes;
         int qty = atoi(buf);
-        
-        pthread_mutex_lock(&lock);
-        int found = 0;
-        for(int i = 0; i < fruit_cnt; i++) {
-            if(strcasecmp(fruits[i].name, fname) == 0) {
-                found = 1;
-                if(fruits[i].qty >= qty) {
-                    fruits[i].qty -= qty;
-                    time_t now = time(NULL);
-                    strftime(fruits[i].last_sold, 30, "%H:%M:%S", localtime(&now));
-                    sprintf(buf, "\n✓ SUCCESS: Purchased %d %s(s)\n", qty, fname);
-                    printf("Client %d purchased %d %s\n", id, qty, fname);
-                } else {
-                    sprintf(buf, "\n✗ REGRET: Only %d %s available (requested %d)\n", fruits[i].qty, fname, qty);
-                    printf("Client %d: Insufficient stock for %s\n", id, fname);
-                }
-                fflush(stdout);
-                break;
-            }
-        }
-        if(!found) sprintf(buf, "\n✗ ERROR: Fruit '%s' not found\n", fname);
-        pthread_mutex_unlock(&lock);
-        
+
+        int left;
+        purchase(cust, fname, qty, buf, &left, &lsn);
+        sales_log_wait(lsn);
         send(sock, buf, strlen(buf), 0);
+        customer_seen(cust, io + strlen(buf));
     }
-    
+
     printf("Client %d disconnected\n", id);
     fflush(stdout);
     close(sock);
     return NULL;
 }
 
-int main() {
+/* ---------- epoll mode ---------- */
+
+// Where a customer is in the stock -> fruit name -> quantity dialogue;
+// binary clients stay in ST_BINARY until they say goodbye
+enum { ST_ID, ST_NAME, ST_QTY, ST_BINARY, ST_CLOSING };
+
+typedef struct EventLoop EventLoop;
+
+typedef struct Conn {
+    int sock;
+    int epfd;
+    EventLoop *loop;
+    int state;
+    int id;
+    int id_len;           // bytes of the customer id received so far
+    Customer *cust;
+    char fname[50];
+    char *in;             // binary mode: unparsed input, IN_CAP bytes
+    size_t in_len;
+    char *out;            // pending output, sent as the socket drains
+    size_t out_len, out_off, out_cap;
+    uint32_t armed;       // epoll events currently registered
+    unsigned long hold_lsn;   // output waits until this sale is logged; 0 if not held
+    struct Conn *held_prev, *held_next;
+} Conn;
+
+struct EventLoop {
+    int epfd;
+    int wake_fd;          // the sales log rings it after every batch it finishes
+    Conn *held;           // connections with output held for the sales log
+    pthread_t tid;
+};
+
+void set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+int conn_queue(Conn *c, const char *data, size_t len) {
+    if(c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : MAX;
+        while(cap < c->out_len + len) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if(!p) return -1;
+        c->out = p;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+// Write-through: send straight from data while nothing is pending and copy
+// only what the socket would not take.
+int conn_send(Conn *c, const char *data, size_t len) {
+    if(c->cust) customer_seen(c->cust, len);
+    if(c->out_len == 0 && !c->hold_lsn) {
+        ssize_t s = send(c->sock, data, len, MSG_NOSIGNAL);
+        if(s < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+        if(s > 0) {
+            data += s;
+            len -= s;
+        }
+    }
+    return len ? conn_queue(c, data, len) : 0;
+}
+
+// Keep everything queued from now on until the sale with this lsn is
+// logged; the loop must not block in sales_log_wait() for it
+void conn_hold(Conn *c, unsigned long lsn) {
+    if(sales_log_done(lsn)) return;
+    if(lsn > c->hold_lsn) c->hold_lsn = lsn;
+    if(c->held_prev || c->loop->held == c) return;
+    c->held_next = c->loop->held;
+    if(c->held_next) c->held_next->held_prev = c;
+    c->loop->held = c;
+}
+
+void conn_unhold(Conn *c) {
+    if(c->held_prev) c->held_prev->held_next = c->held_next;
+    else if(c->loop->held == c) c->loop->held = c->held_next;
+    if(c->held_next) c->held_next->held_prev = c->held_prev;
+    c->held_prev = c->held_next = NULL;
+    c->hold_lsn = 0;
+}
+
+void conn_close(Conn *c) {
+    conn_unhold(c);
+    if(c->cust) {
+        printf("Client %d disconnected\n", c->cust->id);
+        fflush(stdout);
+    }
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Send as much pending output as the socket takes. Returns -1 if the connection is gone.
+int conn_flush(Conn *c) {
+    while(!c->hold_lsn && c->out_off < c->out_len) {
+        ssize_t s = send(c->sock, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if(s < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->out_off += s;
+    }
+    // Keep the unsent tail at the front, so the buffer only grows with it
+    if(c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+
+    // A client that pipelines requests but never reads its replies stops
+    // being read once OUT_PAUSE bytes are waiting, so it cannot make the
+    // buffer grow without bound; reading resumes when the socket drains
+    uint32_t want = 0;
+    if(c->out_len <= OUT_PAUSE) want |= EPOLLIN | EPOLLRDHUP;
+    if(c->out_len > 0 && !c->hold_lsn) want |= EPOLLOUT;
+    if(want != c->armed) {
+        struct epoll_event ev;
+        ev.events = want;
+        ev.data.ptr = c;
+        epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        c->armed = want;
+    }
+    return 0;
+}
+
+int conn_send_stock(Conn *c) {
+    const StockSnapshot *snap = snapshot_acquire();
+    int r = conn_send(c, snap->text, snap->len);
+    snapshot_release(snap);
+    if(r < 0) return -1;
+    return conn_send(c, prompt, sizeof(prompt) - 1);
+}
+
+// Binary mode: parse every frame this read completed and queue the replies
+// as one batch, held until the batch's last sale is logged
+int conn_on_frames(Conn *c) {
+    static __thread TextBuf out;
+    ssize_t bytes = recv(c->sock, c->in + c->in_len, IN_CAP - c->in_len, 0);
+    if(bytes < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if(bytes <= 0) return -1;
+    c->in_len += bytes;
+
+    int closing = 0;
+    unsigned long lsn;
+    out.len = 0;
+    long used = handle_frames(&c->cust, c->in, c->in_len, &out, &closing, &lsn);
+    conn_hold(c, lsn);
+    if(c->cust) customer_seen(c->cust, bytes);
+    if(out.len && conn_send(c, out.data, out.len) < 0) return -1;
+    if(used < 0 || closing) {
+        c->state = ST_CLOSING;
+        return 0;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return 0;
+}
+
+// Advance the dialogue by one received message. Returns -1 to drop the connection.
+int conn_on_readable(Conn *c) {
+    char buf[MAX];
+    ssize_t bytes;
+    unsigned long lsn;
+
+    if(c->state == ST_ID) {
+        bytes = recv(c->sock, (char*)&c->id + c->id_len, sizeof(int) - c->id_len, 0);
+        if(bytes < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if(bytes <= 0) return -1;
+        c->id_len += bytes;
+        if(c->id_len < (int)sizeof(int)) return 0;
+
+        if(get_u32((char*)&c->id) == PROTO_MAGIC) {
+            if(!(c->in = malloc(IN_CAP))) return -1;
+            c->state = ST_BINARY;
+            return 0;
+        }
+
+        printf("Client %d connected\n", c->id);
+        fflush(stdout);
+        if(!(c->cust = add_client(c->id))) return -1;
+        c->state = ST_NAME;
+        return conn_send_stock(c);
+    }
+
+    if(c->state == ST_BINARY) return conn_on_frames(c);
+
+    // Like the threaded handler, one recv is one message of the dialogue
+    memset(buf, 0, MAX);
+    bytes = recv(c->sock, buf, MAX - 1, 0);
+    if(bytes < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if(bytes <= 0) return -1;
+    if(c->state == ST_CLOSING) return 0;   // discard input until the goodbye is flushed
+    customer_seen(c->cust, bytes);
+
+    if(c->state == ST_NAME) {
+        buf[strcspn(buf, "\n")] = 0;
+        if(strcmp(buf, "exit") == 0) {
+            c->state = ST_CLOSING;
+            return conn_send(c, "Thank you! Goodbye.\n", 20);
+        }
+        if(strncasecmp(buf, "order ", 6) == 0) {
+            char reply[MAX];
+            order_from_text(c->cust, buf + 6, reply, &lsn);
+            conn_hold(c, lsn);
+            if(conn_send(c, reply, strlen(reply)) < 0) return -1;
+            return conn_send_stock(c);
+        }
+        strncpy(c->fname, buf, sizeof(c->fname) - 1);
+        c->fname[sizeof(c->fname) - 1] = 0;
+        c->state = ST_QTY;
+        return conn_send(c, "Enter quantity: ", 16);
+    }
+
+    if(c->state == ST_QTY) {
+        int qty = atoi(buf), left;
+        purchase(c->cust, c->fname, qty, buf, &left, &lsn);
+        conn_hold(c, lsn);
+        c->state = ST_NAME;
+        if(conn_send(c, buf, strlen(buf)) < 0) return -1;
+        return conn_send_stock(c);
+    }
+    return 0;
+}
+
+// Send what was held for sales that the log has now finished
+void release_held(EventLoop *loop) {
+    uint64_t n;
+    if(read(loop->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+    for(Conn *c = loop->held, *next; c; c = next) {
+        next = c->held_next;
+        if(!sales_log_done(c->hold_lsn)) continue;
+        conn_unhold(c);
+        if(conn_flush(c) < 0 || (c->state == ST_CLOSING && c->out_len == 0)) conn_close(c);
+    }
+}
+
+void* event_loop(void* arg) {
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(1) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        int woken = 0;
+        for(int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            int dead = 0;
+
+            // After the batch, so no connection closed there is still in events[]
+            if(!c) {
+                woken = 1;
+                continue;
+            }
+
+            if(ev & EPOLLIN) dead = conn_on_readable(c) < 0;
+            else if(ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) dead = 1;
+            if(!dead) dead = conn_flush(c) < 0;
+            if(!dead && c->state == ST_CLOSING && c->out_len == 0) dead = 1;
+
+            if(dead) conn_close(c);
+        }
+        if(woken) release_held(loop);
+    }
+    return NULL;
+}
+
+void run_epoll(int srv, int nloops) {
+    EventLoop *loops = calloc(nloops, sizeof(EventLoop));
+    for(int i = 0; i < nloops; i++) {
+        loops[i].epfd = epoll_create1(0);
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        if(loops[i].epfd < 0 || loops[i].wake_fd < 0) {
+            perror("epoll_create1/eventfd");
+            exit(1);
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) < 0 ||
+           sales_log_watch(loops[i].wake_fd) < 0) {
+            printf("Event loop %d cannot watch the sales log (at most %d loops)\n", i, SALES_LOG_WATCHERS);
+            exit(1);
+        }
+        pthread_create(&loops[i].tid, NULL, event_loop, &loops[i]);
+    }
+
+    // Accept here and hand connections round-robin to the loops
+    int next = 0;
+    while(1) {
+        int sock = accept(srv, NULL, NULL);
+        if(sock < 0) {
+            perror("Accept failed");
+            continue;
+        }
+        set_nonblocking(sock);
+
+        Conn *c = calloc(1, sizeof(Conn));
+        c->sock = sock;
+        c->epfd = loops[next].epfd;
+        c->loop = &loops[next];
+        c->state = ST_ID;
+        c->armed = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event ev;
+        ev.events = c->armed;
+        ev.data.ptr = c;
+        if(epoll_ctl(c->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl");
+            close(sock);
+            free(c);
+            continue;
+        }
+        next = (next + 1) % nloops;
+    }
+}
+
+int main(int argc, char *argv[]) {
     int srv, *cli;
     struct sockaddr_in addr;
-    
-    init_fruits();
-    
+    int use_epoll = 0, nloops = DEFAULT_LOOPS, opt;
+    const char *catalog = NULL, *state_dir = NULL;
+    int durable = 1, restored = 0;
+
+    while((opt = getopt(argc, argv, "m:l:c:d:a")) != -1) {
+        if(opt == 'm' && strcmp(optarg, "epoll") == 0) use_epoll = 1;
+        else if(opt == 'm' && strcmp(optarg, "thread") == 0) use_epoll = 0;
+        else if(opt == 'l') nloops = atoi(optarg);
+        else if(opt == 'c') catalog = optarg;
+        else if(opt == 'd') state_dir = optarg;
+        else if(opt == 'a') durable = 0;
+        else {
+            printf("Usage: %s [-m thread|epoll] [-l event_loops] [-c catalog_file] [-d state_dir [-a]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(nloops < 1) nloops = 1;
+
+    // The thread-per-client path writes with writev()/send() and no
+    // MSG_NOSIGNAL: a pipelining client that closes with replies in flight
+    // must only end its own thread (EPIPE), not the store
+    signal(SIGPIPE, SIG_IGN);
+
+    if(state_dir && (restored = sales_log_restore(state_dir)) < 0) {
+        perror("Sales log restore failed");
+        exit(1);
+    }
+    if(restored) {
+        printf("Restored stock from %s\n", state_dir);
+    } else if(catalog) {
+        if(load_fruits(catalog) < 0) {
+            perror("Catalog load failed");
+            exit(1);
+        }
+    } else {
+        init_fruits();
+    }
+    if(state_dir && sales_log_start(state_dir, durable) < 0) {
+        perror("Sales log start failed");
+        exit(1);
+    }
+    if(snapshot_init(render_stock) < 0) {
+        printf("Stock snapshot render failed\n");
+        exit(1);
+    }
+
     srv = socket(AF_INET, SOCK_STREAM, 0);
     if(srv < 0) {
         perror("Socket failed");
         exit(1);
     }
-    
-    int opt = 1;
+
+    opt = 1;
     setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     setsockopt(srv, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
-    
+
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(PORT);
-    
+
     if(bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("Bind failed");
         exit(1);
     }
-    
-    if(listen(srv, 10) < 0) {
+
+    if(listen(srv, use_epoll ? SOMAXCONN : 10) < 0) {
         perror("Listen failed");
         exit(1);
     }
-    
+
     printf("=================================\n");
     printf("Fruit Store Server Started\n");
     printf("Port: %d\n", PORT);
+    printf("Catalog: %d fruits\n", fruit_count());
+    if(use_epoll) printf("Mode: epoll (%d event loops)\n", nloops);
+    else printf("Mode: thread per client\n");
     printf("Waiting for clients...\n");
     printf("=================================\n");
     fflush(stdout);
-    
+
+    if(use_epoll) {
+        run_epoll(srv, nloops);
+        return 0;
+    }
+
     while(1) {
         cli = malloc(sizeof(int));
         *cli = accept(srv, NULL, NULL);
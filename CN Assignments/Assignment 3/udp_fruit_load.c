@@ -0,0 +1,169 @@
+// Load generator for the UDP fruit store (server3).
+// Compile: gcc -O2 udp_fruit_load.c -o udp_fruit_load -pthread
+// Run: ./udp_fruit_load [server_ip] [threads] [window] [seconds] [catalog_file]
+//
+// Each thread keeps `window` requests in flight on its own socket: it sends
+// them with one sendmmsg, collects the replies with recvmmsg and sends the
+// next window. Requests alternate between buying 1 of a random fruit and
+// viewing stock. Fruits come from catalog_file ("name qty" per line, as for
+// the server's -c; default the five default fruits). Start the server with
+// the same file and stock enough for the run, or it soon measures REGRETs:
+// they are reported apart from successful purchases.
+// Every request carries its own seq, so a reply that arrives after its
+// window timed out is counted late instead of answering the next window.
+// Prints replies per second; lost datagrams are counted, not retried.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <time.h>
+#include "../common/fruit_load.h"
+
+#define PORT 8080
+#define MAX_WINDOW 64
+
+typedef struct {
+    int idx;
+    long replies, bought, regret, lost, late;
+} Worker;
+
+const char *server_ip = "127.0.0.1";
+int window = 16;
+atomic_int running = 1;
+
+char (*names)[50];
+int nnames;
+
+void* worker(void* arg) {
+    Worker *w = arg;
+    Request reqs[MAX_WINDOW];
+    Response ress[MAX_WINDOW];
+    struct iovec out_iov[MAX_WINDOW], in_iov[MAX_WINDOW];
+    struct mmsghdr out[MAX_WINDOW], in[MAX_WINDOW];
+    struct sockaddr_in server_addr;
+    char answered[MAX_WINDOW];
+    // Seeded from the clock too: a rerun must not reuse seqs the server has cached replies for
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (w->idx + 1) ^ (uint64_t)time(NULL);
+    unsigned seq = (unsigned)rng_next(&rng);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock < 0) {
+        perror("Socket failed");
+        return NULL;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    // connect() so the replies can be read without source addresses
+    if(connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connect failed");
+        close(sock);
+        return NULL;
+    }
+    struct timeval tv = {0, 200000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(reqs, 0, sizeof(reqs));
+    memset(out, 0, sizeof(out));
+    memset(in, 0, sizeof(in));
+    for(int i = 0; i < window; i++) {
+        reqs[i].id = 100000 + w->idx;
+        reqs[i].qty = 1;
+        reqs[i].action = i % 2 ? 1 : 2;
+        out_iov[i].iov_base = &reqs[i];
+        out_iov[i].iov_len = offsetof(Request, nlines);   // actions 1-3 need no more
+        out[i].msg_hdr.msg_iov = &out_iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+        in_iov[i].iov_base = &ress[i];
+        in_iov[i].iov_len = sizeof(Response);
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(running) {
+        // This window's seqs are first..first + window - 1, never 0
+        if(seq + 1 == 0 || seq + (unsigned)window < seq) seq = 0;
+        unsigned first = seq + 1;
+        for(int i = 0; i < window; i++) {
+            reqs[i].seq = first + i;
+            if(reqs[i].action == 2) strcpy(reqs[i].fruit_name, names[rng_next(&rng) % nnames]);
+        }
+        seq += window;
+
+        int sent = 0;
+        while(sent < window) {
+            int r = sendmmsg(sock, out + sent, window - sent, 0);
+            if(r <= 0) break;
+            sent += r;
+        }
+        memset(answered, 0, sent);
+        int got = 0;
+        while(got < sent) {
+            int r = recvmmsg(sock, in, sent - got, MSG_WAITFORONE, NULL);
+            if(r <= 0) break;   // timed out: the rest were lost
+            for(int i = 0; i < r; i++) {
+                unsigned k = ress[i].seq - first;
+                if(in[i].msg_len < offsetof(Response, message) || k >= (unsigned)sent || answered[k]) {
+                    w->late++;  // for a window that already timed out
+                    continue;
+                }
+                answered[k] = 1;
+                got++;
+                if(reqs[k].action != 2) continue;
+                if(ress[i].success) w->bought++;
+                else w->regret++;
+            }
+        }
+        w->replies += got;
+        w->lost += sent - got;
+    }
+    close(sock);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc > 1) server_ip = argv[1];
+    int nthreads = argc > 2 ? atoi(argv[2]) : 4;
+    if(argc > 3) window = atoi(argv[3]);
+    int secs = argc > 4 ? atoi(argv[4]) : 5;
+    if(nthreads < 1) nthreads = 1;
+    if(window < 1) window = 1;
+    if(window > MAX_WINDOW) window = MAX_WINDOW;
+    if(secs < 1) secs = 1;
+    if((nnames = load_names(argc > 5 ? argv[5] : NULL, &names)) < 0) {
+        perror("Catalog load failed");
+        exit(1);
+    }
+
+    pthread_t tids[nthreads];
+    Worker w[nthreads];
+    for(int i = 0; i < nthreads; i++) {
+        w[i].idx = i;
+        w[i].replies = w[i].bought = w[i].regret = w[i].lost = w[i].late = 0;
+        pthread_create(&tids[i], NULL, worker, &w[i]);
+    }
+    sleep(secs);
+    running = 0;
+
+    long replies = 0, bought = 0, regret = 0, lost = 0, late = 0;
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        replies += w[i].replies;
+        bought += w[i].bought;
+        regret += w[i].regret;
+        lost += w[i].lost;
+        late += w[i].late;
+    }
+    printf("%d threads x %d in flight over %d fruits: %.0f replies/s, %ld lost, %ld late\n",
+           nthreads, window, nnames, (double)replies / secs, lost, late);
+    printf("purchases: %ld bought, %ld regret\n", bought, regret);
+    return 0;
+}
@@ -1,33 +1,81 @@
+// Every request carries a sequence number. A request that gets no reply
+// within RETRY_MS is sent again with the same number, so the server can
+// answer a retried purchase from its reply cache instead of buying twice.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 
 #define PORT 8080
 #define MAX 1024
+#define MAX_ORDER_LINES 20
+#define RETRY_MS 100    // first timeout; doubles on every retry
+#define RETRIES 5
+
+typedef struct {
+    char fruit_name[50];
+    int qty;
+} OrderItem;
 
 typedef struct {
     int id;
     char fruit_name[50];
     int qty;
-    int action; // 1=view_stock, 2=purchase, 3=exit
+    int action; // 1=view_stock, 2=purchase, 3=exit, 4=order
+    unsigned seq; // per-request number, same on retries
+    int nlines; // order: lines[0..nlines), may be cut off after the last used line
+    OrderItem lines[MAX_ORDER_LINES];
 } Request;
 
 typedef struct {
-    char message[MAX];
     int success;
+    unsigned seq;       // echoes the request
+    char message[MAX];  // the server sends only up to the NUL
 } Response;
 
+unsigned next_seq;
+
+// Sends req (len bytes) and waits for the reply with its seq, retrying with
+// the same seq on timeout. Late replies to earlier requests are dropped.
+// Returns 0, or -1 if the server never answered.
+int transact(int sock, struct sockaddr_in *server, Request *req, size_t len, Response *res) {
+    if(++next_seq == 0) next_seq = 1;
+    req->seq = next_seq;
+    
+    int timeout = RETRY_MS;
+    for(int attempt = 0; attempt <= RETRIES; attempt++, timeout *= 2) {
+        sendto(sock, req, len, 0, (struct sockaddr*)server, sizeof(*server));
+        
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        while(poll(&pfd, 1, timeout) > 0) {
+            ssize_t n = recvfrom(sock, res, sizeof(*res) - 1, 0, NULL, NULL);
+            if(n < (ssize_t)offsetof(Response, message) || res->seq != req->seq) continue;
+            ((char*)res)[n] = 0;
+            return 0;
+        }
+    }
+    strcpy(res->message, "\n✗ ERROR: No reply from server\n");
+    res->success = 0;
+    return -1;
+}
+
 int main() {
     int sock;
     struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(server_addr);
     char ip[20];
     int id;
     Request req;
     Response res;
     
+    // Random start, so a restarted client never reuses a cached seq
+    srand(time(NULL) ^ getpid());
+    next_seq = rand();
+    
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if(sock < 0) {
         perror("Socket creation failed");
@@ -74,32 +122,56 @@ int main() {
         req.id = id;
         req.action = 1; // View stock
         
-        sendto(sock, &req, sizeof(req), 0, 
-               (struct sockaddr*)&server_addr, addr_len);
-        
-        recvfrom(sock, &res, sizeof(res), 0, NULL, NULL);
+        transact(sock, &server_addr, &req, offsetof(Request, nlines), &res);
         
         printf("%s", res.message);
-        printf("\nEnter fruit name (or 'exit'): ");
+        printf("\nEnter fruit name, 'order fruit qty [fruit qty ...]' or 'exit': ");
         fflush(stdout);
         
-        char fruit[50];
-        fgets(fruit, 50, stdin);
+        char fruit[MAX];
+        fgets(fruit, MAX, stdin);
         fruit[strcspn(fruit, "\n")] = 0;
         
+        if(strncmp(fruit, "order ", 6) == 0) {
+            // Whole basket in one datagram, bought all-or-nothing
+            memset(&req, 0, sizeof(req));
+            memset(&res, 0, sizeof(res));
+            req.id = id;
+            req.action = 4;
+            
+            char *p = fruit + 6;
+            int used;
+            while(req.nlines < MAX_ORDER_LINES &&
+                  sscanf(p, "%49s %d%n", req.lines[req.nlines].fruit_name,
+                         &req.lines[req.nlines].qty, &used) == 2) {
+                req.nlines++;
+                p += used;
+            }
+            
+            transact(sock, &server_addr, &req, offsetof(Request, lines) + req.nlines * sizeof(OrderItem), &res);
+            printf("%s", res.message);
+            fflush(stdout);
+            
+            printf("\nPress Enter to continue...");
+            getchar();
+            continue;
+        }
+        
         if(strcmp(fruit, "exit") == 0) {
             memset(&req, 0, sizeof(req));
             req.id = id;
             req.action = 3; // Exit
             
-            sendto(sock, &req, sizeof(req), 0, 
-                   (struct sockaddr*)&server_addr, addr_len);
-            
-            recvfrom(sock, &res, sizeof(res), 0, NULL, NULL);
+            transact(sock, &server_addr, &req, offsetof(Request, nlines), &res);
             printf("%s", res.message);
             break;
         }
         
+        if(strlen(fruit) >= sizeof(req.fruit_name)) {
+            printf("\n✗ ERROR: Fruit names are at most %zu characters\n", sizeof(req.fruit_name) - 1);
+            continue;
+        }
+        
         printf("Enter quantity: ");
         fflush(stdout);
         int qty;
@@ -115,10 +187,7 @@ int main() {
         strcpy(req.fruit_name, fruit);
         req.qty = qty;
         
-        sendto(sock, &req, sizeof(req), 0, 
-               (struct sockaddr*)&server_addr, addr_len);
-        
-        recvfrom(sock, &res, sizeof(res), 0, NULL, NULL);
+        transact(sock, &server_addr, &req, offsetof(Request, nlines), &res);
         
         printf("%s", res.message);
         fflush(stdout);
@@ -1,86 +1,282 @@
+// Compile: gcc udp_fruit_store_server.c ../common/fruit_catalog.c ../common/stock_snapshot.c ../common/customer_registry.c ../common/sales_log.c -o server3 -pthread
+// Run: ./server3 [-c catalog_file] [-w workers] [-d state_dir [-a]] [-q]
+//   -w - number of worker threads (default 1). Each opens its own
+//        SO_REUSEPORT socket on the port, so the kernel spreads clients
+//        across them by address hash, and is pinned to a CPU.
+//   -d - keep stock across restarts in a sales log in state_dir (see
+//        sales_log.h); a batch's replies go out once its sales are fsynced
+//   -a - with -d, skip the fsync: replies wait only for the write
+//   -q - quiet: no per-request log lines
+// Purchases and orders carrying a seq number are answered once: the reply is
+// kept in a per-worker cache keyed by (customer, seq), and a retransmit gets
+// the cached reply instead of buying again.
+// Requests are received and answered in batches of up to BATCH datagrams
+// with recvmmsg/sendmmsg; a reply carries only the used part of message.
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include "../common/fruit_catalog.h"
+#include "../common/stock_snapshot.h"
+#include "../common/customer_registry.h"
+#include "../common/sales_log.h"
 
 #define PORT 8080
 #define MAX 1024
+#define BATCH 64
+#define REPLY_SLOTS 1024    // per worker, power of two
 
 typedef struct {
-    char name[50];
+    char fruit_name[50];
     int qty;
-    char last_sold[30];
-} Fruit;
+} OrderItem;
 
 typedef struct {
     int id;
     char fruit_name[50];
     int qty;
-    int action; // 1=view_stock, 2=purchase, 3=exit
+    int action; // 1=view_stock, 2=purchase, 3=exit, 4=order
+    unsigned seq; // per-request number, same on retries; 0 = not cached
+    int nlines; // order: lines[0..nlines), may be cut off after the last used line
+    OrderItem lines[MAX_ORDER_LINES];
 } Request;
 
 typedef struct {
-    char message[MAX];
     int success;
+    unsigned seq;       // echoes the request
+    char message[MAX];  // NUL-terminated; only the used part is sent
 } Response;
 
-Fruit fruits[10];
-int fruit_cnt = 0;
-int clients[100], client_cnt = 0;
-
-void init_fruits() {
-    strcpy(fruits[0].name, "Apple"); fruits[0].qty = 100;
-    strcpy(fruits[1].name, "Banana"); fruits[1].qty = 150;
-    strcpy(fruits[2].name, "Orange"); fruits[2].qty = 80;
-    strcpy(fruits[3].name, "Mango"); fruits[3].qty = 60;
-    strcpy(fruits[4].name, "Grapes"); fruits[4].qty = 120;
-    fruit_cnt = 5;
-    for(int i = 0; i < 5; i++) strcpy(fruits[i].last_sold, "Never");
+// Replies of recent purchases/orders. Direct-mapped: a new entry overwrites
+// whatever hashed to its slot, so the cache stays bounded and a retry only
+// misses if REPLY_SLOTS newer requests landed on this worker in between.
+// SO_REUSEPORT sends a client's retries to the same socket, so per-worker
+// caches need no locking.
+typedef struct {
+    int id;
+    unsigned seq;       // 0 = empty slot
+    unsigned long lsn;  // sales log record the reply must not overtake
+    size_t len;
+    Response res;
+} CachedReply;
+
+// One per worker thread; everything a batch needs is preallocated here
+typedef struct {
+    int sock;
+    int cpu;
+    Request reqs[BATCH];
+    Response ress[BATCH];
+    struct sockaddr_in addrs[BATCH];
+    struct iovec in_iov[BATCH], out_iov[BATCH];
+    struct mmsghdr in[BATCH], out[BATCH];
+    CachedReply cache[REPLY_SLOTS];
+} Worker;
+
+int quiet = 0;
+
+Customer *add_client(int id) {
+    int is_new;
+    Customer *c = customer_get(id, &is_new);
+    if(is_new) snapshot_touch();
+    return c;
 }
 
-void add_client(int id) {
-    for(int i = 0; i < client_cnt; i++)
-        if(clients[i] == id) return;
-    clients[client_cnt++] = id;
+// Only runs when a purchase or a new customer has made the snapshot stale
+void render_stock(TextBuf *tb) {
+    tb_printf(tb, "\n=== Current Stock ===\n");
+    int n = fruit_count();
+    for(int i = 0; i < n; i++) {
+        Fruit *f = fruit_at(i);
+        char last[30];
+        fruit_last_sold(f, last, sizeof(last));
+        tb_printf(tb, "%d. %s: Qty=%d, Last=%s\n", i+1, f->name, atomic_load(&f->qty), last);
+    }
+    
+    int total = customer_count();
+    tb_printf(tb, "\n=== Customer List ===\n");
+    for(int i = 0; i < total && i < CUSTOMER_LIST_MAX; i++) {
+        Customer *c = customer_listed(i);
+        if(c) tb_printf(tb, "Customer ID: %d (%ld purchases)\n", c->id, atomic_load(&c->purchases));
+    }
+    if(total > CUSTOMER_LIST_MAX) tb_printf(tb, "... and %d more\n", total - CUSTOMER_LIST_MAX);
+    tb_printf(tb, "Total Customers: %d\n", total);
 }
 
+// One datagram's worth of the stock view. A view that does not fit is cut
+// after its last whole line and ends with a count of the lines left out.
 void get_stock_info(char *buf) {
-    sprintf(buf, "\n=== Current Stock ===\n");
-    for(int i = 0; i < fruit_cnt; i++) {
-        char tmp[200];
-        sprintf(tmp, "%d. %s: Qty=%d, Last=%s\n", i+1, fruits[i].name, fruits[i].qty, fruits[i].last_sold);
-        strcat(buf, tmp);
+    const StockSnapshot *snap = snapshot_acquire();
+    size_t len = snap->len;
+    if(len > MAX - 1) {
+        len = MAX - 40;     // room for the trailer
+        while(len > 0 && snap->text[len - 1] != '\n') len--;
+        int more = 0;
+        for(const char *p = snap->text + len, *end = snap->text + snap->len; p < end; more++) {
+            const char *nl = memchr(p, '\n', end - p);
+            p = nl ? nl + 1 : end;
+        }
+        memcpy(buf, snap->text, len);
+        snprintf(buf + len, MAX - len, "... %d more line%s\n", more, more == 1 ? "" : "s");
+    } else {
+        memcpy(buf, snap->text, len);
+        buf[len] = 0;
+    }
+    snapshot_release(snap);
+}
+
+// All-or-nothing basket (action 4)
+void place_order(Customer *cust, Request *req, Response *res, unsigned long *lsn) {
+    OrderLine lines[MAX_ORDER_LINES];
+    int n = req->nlines, short_line, left;
+    
+    res->success = 0;
+    if(n < 1 || n > MAX_ORDER_LINES) {
+        sprintf(res->message, "\n✗ ERROR: Orders take 1-%d lines\n", MAX_ORDER_LINES);
+        return;
+    }
+    for(int i = 0; i < n; i++) {
+        req->lines[i].fruit_name[sizeof(req->lines[i].fruit_name) - 1] = 0;
+        if(req->lines[i].qty <= 0) {
+            sprintf(res->message, "\n✗ ERROR: Order quantities must be positive\n");
+            return;
+        }
+        if(!(lines[i].fruit = find_fruit(req->lines[i].fruit_name))) {
+            sprintf(res->message, "\n✗ ERROR: Fruit '%s' not found\n", req->lines[i].fruit_name);
+            return;
+        }
+        lines[i].qty = req->lines[i].qty;
     }
     
-    strcat(buf, "\n=== Customer List ===\n");
-    for(int i = 0; i < client_cnt; i++) {
-        char tmp[50];
-        sprintf(tmp, "Customer ID: %d\n", clients[i]);
-        strcat(buf, tmp);
+    if(!sales_log_order(lines, &n, &short_line, &left, lsn)) {
+        sprintf(res->message, "\n✗ REGRET: Order cancelled, only %d %s available (requested %d)\n",
+                left, lines[short_line].fruit->name, lines[short_line].qty);
+        if(!quiet) printf("Client %d: Order cancelled, insufficient stock for %s\n", req->id, lines[short_line].fruit->name);
+        return;
     }
-    sprintf(buf + strlen(buf), "Total Customers: %d\n", client_cnt);
+    
+    int len = sprintf(res->message, "\n✓ SUCCESS: Ordered");
+    for(int i = 0; i < n; i++) {
+        if(len < MAX - 80)
+            len += sprintf(res->message + len, "%s %d %s", i ? "," : "", lines[i].qty, lines[i].fruit->name);
+        customer_purchased(cust);
+    }
+    strcpy(res->message + len, "\n");
+    res->success = 1;
+    snapshot_touch();
+    if(!quiet) printf("Client %d ordered %d item(s)\n", req->id, n);
 }
 
-int main() {
-    int sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    Request req;
-    Response res;
+// The reply cache slot for (id, seq)
+CachedReply *cache_slot(CachedReply *cache, int id, unsigned seq) {
+    unsigned h = (unsigned)id * 0x9E3779B1u ^ seq * 0x85EBCA77u;
+    return &cache[(h ^ h >> 16) & (REPLY_SLOTS - 1)];
+}
+
+// Handles one datagram of `bytes` bytes and fills res. Returns the reply
+// length (header + used message), or 0 to send nothing. *lsn is set to the
+// sales log record the reply depends on, or 0.
+size_t handle_request(CachedReply *cache, Request *req, int bytes, Response *res, unsigned long *lsn) {
+    if(bytes <= 0) return 0;
+    // Short datagrams (clients send only the used prefix) read as zeros
+    if((size_t)bytes < sizeof(Request)) memset((char*)req + bytes, 0, sizeof(Request) - bytes);
+    req->fruit_name[sizeof(req->fruit_name) - 1] = 0;
+    res->success = 0;
+    res->seq = req->seq;
+    res->message[0] = 0;
+    *lsn = 0;
+    
+    Customer *cust = add_client(req->id);
+    if(!cust) return 0;
+    
+    // Only requests that change stock are worth remembering
+    CachedReply *slot = NULL;
+    if(req->seq && (req->action == 2 || req->action == 4)) {
+        slot = cache_slot(cache, req->id, req->seq);
+        if(slot->seq == req->seq && slot->id == req->id) {
+            memcpy(res, &slot->res, slot->len);
+            *lsn = slot->lsn;   // may still be on its way to disk
+            if(!quiet) printf("Client %d: retransmit of #%u answered from cache\n", req->id, req->seq);
+            customer_seen(cust, bytes + slot->len);
+            return slot->len;
+        }
+    }
     
-    init_fruits();
+    if(req->action == 1) {
+        // View stock
+        get_stock_info(res->message);
+        res->success = 1;
+        if(!quiet) printf("Client %d requested stock info\n", req->id);
+        
+    } else if(req->action == 2) {
+        // Purchase
+        Fruit *f = find_fruit(req->fruit_name);
+        int left;
+        if(!f) {
+            sprintf(res->message, "\n✗ ERROR: Fruit '%s' not found\n", req->fruit_name);
+            res->success = 0;
+        } else if(req->qty <= 0) {
+            sprintf(res->message, "\n✗ ERROR: Quantity must be positive\n");
+            res->success = 0;
+        } else if(sales_log_buy(f, req->qty, &left, lsn)) {
+            customer_purchased(cust);
+            snapshot_touch();
+            sprintf(res->message, "\n✓ SUCCESS: Purchased %d %s(s)\n", 
+                    req->qty, req->fruit_name);
+            res->success = 1;
+            if(!quiet) printf("Client %d purchased %d %s\n", req->id, req->qty, req->fruit_name);
+        } else {
+            sprintf(res->message, "\n✗ REGRET: Only %d %s available (requested %d)\n", 
+                    left, req->fruit_name, req->qty);
+            res->success = 0;
+            if(!quiet) printf("Client %d: Insufficient stock for %s\n", req->id, req->fruit_name);
+        }
+        
+    } else if(req->action == 4) {
+        place_order(cust, req, res, lsn);
+        
+    } else if(req->action == 3) {
+        // Exit
+        sprintf(res->message, "Thank you! Goodbye.\n");
+        res->success = 1;
+        if(!quiet) printf("Client %d disconnected\n", req->id);
+    }
+    
+    size_t len = offsetof(Response, message) + strlen(res->message) + 1;
+    if(slot) {
+        slot->id = req->id;
+        slot->seq = req->seq;
+        slot->lsn = *lsn;
+        slot->len = len;
+        memcpy(&slot->res, res, len);
+    }
+    customer_seen(cust, bytes + len);
+    return len;
+}
+
+int open_socket(int reuseport) {
+    struct sockaddr_in server_addr;
+    int opt = 1;
     
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if(sock < 0) {
         perror("Socket failed");
         exit(1);
     }
     
-    int opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if(reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(1);
+    }
     
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(PORT);
@@ -89,72 +285,132 @@ int main() {
         perror("Bind failed");
         exit(1);
     }
+    return sock;
+}
+
+// Worker loop: the catalog, snapshot and registry are all safe to share, so
+// workers only ever touch their own socket and batch vectors
+void* serve(void* arg) {
+    Worker *w = arg;
+    
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);   // best effort
+    
+    for(int i = 0; i < BATCH; i++) {
+        w->in_iov[i].iov_base = &w->reqs[i];
+        w->in_iov[i].iov_len = sizeof(Request);
+        w->in[i].msg_hdr.msg_iov = &w->in_iov[i];
+        w->in[i].msg_hdr.msg_iovlen = 1;
+        w->in[i].msg_hdr.msg_name = &w->addrs[i];
+        w->out_iov[i].iov_base = &w->ress[i];
+    }
+    
+    while(1) {
+        for(int i = 0; i < BATCH; i++) w->in[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+        
+        // Blocks for the first datagram, then takes whatever else is queued
+        int n = recvmmsg(w->sock, w->in, BATCH, MSG_WAITFORONE, NULL);
+        if(n <= 0) continue;
+        
+        int m = 0;
+        unsigned long lsn, wait_lsn = 0;
+        for(int i = 0; i < n; i++) {
+            size_t len = handle_request(w->cache, &w->reqs[i], w->in[i].msg_len, &w->ress[i], &lsn);
+            if(lsn > wait_lsn) wait_lsn = lsn;
+            if(len == 0) continue;
+            w->out_iov[i].iov_len = len;
+            memset(&w->out[m], 0, sizeof(w->out[m]));
+            w->out[m].msg_hdr.msg_iov = &w->out_iov[i];
+            w->out[m].msg_hdr.msg_iovlen = 1;
+            w->out[m].msg_hdr.msg_name = &w->addrs[i];
+            w->out[m].msg_hdr.msg_namelen = w->in[i].msg_hdr.msg_namelen;
+            m++;
+        }
+        if(!quiet) fflush(stdout);
+        
+        // One wait for the whole batch; other workers' sales share the fsync
+        sales_log_wait(wait_lsn);
+        for(int sent = 0; sent < m; ) {
+            int r = sendmmsg(w->sock, w->out + sent, m - sent, 0);
+            if(r <= 0) break;
+            sent += r;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, nworkers = 1, durable = 1, restored = 0;
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *catalog = NULL, *state_dir = NULL;
+    
+    while((opt = getopt(argc, argv, "c:w:d:aq")) != -1) {
+        if(opt == 'c') catalog = optarg;
+        else if(opt == 'd') state_dir = optarg;
+        else if(opt == 'a') durable = 0;
+        else if(opt == 'w') nworkers = atoi(optarg);
+        else if(opt == 'q') quiet = 1;
+        else {
+            printf("Usage: %s [-c catalog_file] [-w workers] [-d state_dir [-a]] [-q]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(nworkers < 1) nworkers = 1;
+    if(ncpu < 1) ncpu = 1;
+    Worker *workers[nworkers];
+    
+    if(state_dir && (restored = sales_log_restore(state_dir)) < 0) {
+        perror("Sales log restore failed");
+        exit(1);
+    }
+    if(restored) {
+        printf("Restored stock from %s\n", state_dir);
+    } else if(catalog) {
+        if(load_fruits(catalog) < 0) {
+            perror("Catalog load failed");
+            exit(1);
+        }
+    } else {
+        init_fruits();
+    }
+    if(state_dir && sales_log_start(state_dir, durable) < 0) {
+        perror("Sales log start failed");
+        exit(1);
+    }
+    if(snapshot_init(render_stock) < 0) {
+        printf("Stock snapshot render failed\n");
+        exit(1);
+    }
+    
+    for(int i = 0; i < nworkers; i++) {
+        workers[i] = calloc(1, sizeof(Worker));
+        if(!workers[i]) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        workers[i]->sock = open_socket(nworkers > 1);
+        workers[i]->cpu = i % ncpu;
+    }
     
     printf("=================================\n");
     printf("UDP Fruit Store Server Started\n");
     printf("Port: %d\n", PORT);
+    printf("Catalog: %d fruits\n", fruit_count());
+    printf("Workers: %d\n", nworkers);
     printf("Waiting for requests...\n");
     printf("=================================\n");
     fflush(stdout);
     
-    while(1) {
-        memset(&req, 0, sizeof(req));
-        memset(&res, 0, sizeof(res));
-        
-        int bytes = recvfrom(sock, &req, sizeof(req), 0, 
-                            (struct sockaddr*)&client_addr, &addr_len);
-        
-        if(bytes <= 0) continue;
-        
-        add_client(req.id);
-        
-        if(req.action == 1) {
-            // View stock
-            get_stock_info(res.message);
-            res.success = 1;
-            printf("Client %d requested stock info\n", req.id);
-            
-        } else if(req.action == 2) {
-            // Purchase
-            int found = 0;
-            for(int i = 0; i < fruit_cnt; i++) {
-                if(strcasecmp(fruits[i].name, req.fruit_name) == 0) {
-                    found = 1;
-                    if(fruits[i].qty >= req.qty) {
-                        fruits[i].qty -= req.qty;
-                        time_t now = time(NULL);
-                        strftime(fruits[i].last_sold, 30, "%H:%M:%S", localtime(&now));
-                        sprintf(res.message, "\n✓ SUCCESS: Purchased %d %s(s)\n", 
-                                req.qty, req.fruit_name);
-                        res.success = 1;
-                        printf("Client %d purchased %d %s\n", req.id, req.qty, req.fruit_name);
-                    } else {
-                        sprintf(res.message, "\n✗ REGRET: Only %d %s available (requested %d)\n", 
-                                fruits[i].qty, req.fruit_name, req.qty);
-                        res.success = 0;
-                        printf("Client %d: Insufficient stock for %s\n", req.id, req.fruit_name);
-                    }
-                    break;
-                }
-            }
-            if(!found) {
-                sprintf(res.message, "\n✗ ERROR: Fruit '%s' not found\n", req.fruit_name);
-                res.success = 0;
-            }
-            
-        } else if(req.action == 3) {
-            // Exit
-            sprintf(res.message, "Thank you! Goodbye.\n");
-            res.success = 1;
-            printf("Client %d disconnected\n", req.id);
+    for(int i = 1; i < nworkers; i++) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, serve, workers[i]) != 0) {
+            perror("Thread creation failed");
+            exit(1);
         }
-        
-        fflush(stdout);
-        
-        sendto(sock, &res, sizeof(res), 0, 
-               (struct sockaddr*)&client_addr, addr_len);
+        pthread_detach(tid);
     }
-    
-    close(sock);
+    serve(workers[0]);
     return 0;
 }
@@ -0,0 +1,231 @@
+// calc_bench.c
+// Micro-benchmark: expressions per second for the old strchr-based
+// evaluator against calc_expr: compiling every time, going through the
+// shape cache (as the server does per request) and evaluating an already
+// compiled program. Then values of x per second for batch requests: a
+// cache lookup and calc_run() per value, as one request per value costs
+// the server, against
+// calc_run_batch() with each level of kernels.
+// Compile: gcc -O2 calc_bench.c calc_expr.c calc_cache.c calc_simd.c -o calc_bench -lm
+// Run: ./calc_bench [seconds_per_run]
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "calc_cache.h"
+
+#define BUF 1024
+
+// Trim leading/trailing whitespace
+char *trim(char *s) {
+    while(*s==' '||*s=='\t'||*s=='\n' ) s++;
+    char *end = s + strlen(s) - 1;
+    while(end>s && (*end==' '||*end=='\t'||*end=='\n')) { *end=0; end--; }
+    return s;
+}
+
+int parse_double(const char *s, double *out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end==s) return 0;
+    *out = v;
+    return 1;
+}
+
+int starts_with(const char *s, const char *p) {
+    return strncasecmp(s, p, strlen(p))==0;
+}
+
+// The evaluator udp_calcu_server.c used before calc_expr, kept as the baseline.
+// Evaluate expression. Returns 1 if ok and result in res, else 0 with errmsg.
+int legacy_eval(const char *expr, double *res, char *errmsg, size_t emsglen) {
+    char tmp[BUF];
+    strncpy(tmp, expr, sizeof(tmp)-1); tmp[sizeof(tmp)-1]=0;
+    char *s = trim(tmp);
+
+    // unary functions: sin x  OR sin(x)
+    if (starts_with(s, "sin")) {
+        char *arg = s + 3;
+        if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
+        arg = trim(arg);
+        double x;
+        if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to sin"); return 0; }
+        *res = sin(x); return 1;
+    }
+    if (starts_with(s, "cos")) {
+        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
+        arg = trim(arg);
+        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to cos"); return 0; }
+        *res = cos(x); return 1;
+    }
+    if (starts_with(s, "tan")) {
+        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
+        arg = trim(arg);
+        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to tan"); return 0; }
+        *res = tan(x); return 1;
+    }
+    if (starts_with(s, "inv")) { // inv x  => 1/x
+        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
+        arg = trim(arg);
+        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to inv"); return 0; }
+        if (x == 0) { snprintf(errmsg, emsglen, "divide by zero"); return 0; }
+        *res = 1.0/x; return 1;
+    }
+    if (starts_with(s, "sqrt")) {
+        char *arg = s + 4; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
+        arg = trim(arg);
+        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to sqrt"); return 0; }
+        if (x < 0) { snprintf(errmsg, emsglen, "sqrt of negative"); return 0; }
+        *res = sqrt(x); return 1;
+    }
+
+    // binary operations: try to find + - * /
+    // locate operator (left->right preferred for +,-,* ,/)
+    char *op = NULL;
+    char *plus = strchr(s, '+');
+    char *minus = strchr(s, '-');
+    char *mul = strchr(s, '*');
+    char *divi = strchr(s, '/');
+
+    // prefer first-occurring operator (but handle negative numbers by checking position)
+    // find operator that is not first char (to avoid unary minus)
+    char *candidates[] = {plus, minus, mul, divi};
+    for (int i=0;i<4;i++) {
+        char *p = candidates[i];
+        if (p && p != s) { op = p; break; }
+    }
+
+    if (op) {
+        char left[256], right[256];
+        strncpy(left, s, op - s);
+        left[op - s] = 0;
+        strcpy(right, op+1);
+        char *L = trim(left);
+        char *R = trim(right);
+        double a,b;
+        if (!parse_double(L, &a)) { snprintf(errmsg, emsglen, "bad left operand"); return 0; }
+        if (!parse_double(R, &b)) { snprintf(errmsg, emsglen, "bad right operand"); return 0; }
+        switch(*op) {
+            case '+': *res = a + b; return 1;
+            case '-': *res = a - b; return 1;
+            case '*': *res = a * b; return 1;
+            case '/': if (b==0) { snprintf(errmsg, emsglen, "divide by zero"); return 0; } *res = a / b; return 1;
+        }
+    }
+
+    // maybe single number
+    double v;
+    if (parse_double(s, &v)) { *res = v; return 1; }
+    snprintf(errmsg, emsglen, "unsupported expression");
+    return 0;
+}
+
+
+// Expressions the old evaluator understands
+static const char *simple[] = { "sin 1.57", "3 * 4", "inv 2", "sqrt(2)", "10 / 4", "cos(0.5)", "2.5 - 1" };
+// And some it does not
+static const char *nested[] = { "sin(0.5)*2 + sqrt(3/4)", "(1 + 2) * (3 - 4) / 5", "2^10 - max(3, 4) * cos(pi / 3)" };
+
+#define NSIMPLE (int)(sizeof(simple) / sizeof(simple[0]))
+#define NNESTED (int)(sizeof(nested) / sizeof(nested[0]))
+
+// Batch expressions, each run over BATCH_N values of x
+static const char *batched[] = { "sin(x)", "cos(x)*2+1", "sqrt(x)/(x+1)", "sin(x)*sin(x)+cos(x)*cos(x)", "x^2+3*x-1" };
+#define NBATCHED (int)(sizeof(batched) / sizeof(batched[0]))
+#define BATCH_N 1000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+volatile double sink;
+
+// mode 0: legacy_eval, 1: calc_compile + calc_eval, 2: calc_eval only,
+// 3: calc_cache_get + calc_run
+static double run(const char **exprs, int n, int mode, double secs) {
+    CalcProg progs[16];
+    CalcCache *cache = calc_cache_new(64);
+    char err[128];
+    double r = 0, lits[CALC_MAX_CONSTS];
+    long count = 0;
+
+    for (int i = 0; i < n; i++) calc_compile(exprs[i], &progs[i], err, sizeof(err));
+    double start = now(), elapsed;
+    do {
+        for (int k = 0; k < 1000; k++) {
+            int i = k % n;
+            if (mode == 0) legacy_eval(exprs[i], &r, err, sizeof(err));
+            else if (mode == 1) {
+                CalcProg prog;
+                if (calc_compile(exprs[i], &prog, err, sizeof(err))) calc_eval(&prog, 0, &r, err, sizeof(err));
+            } else if (mode == 3) {
+                const CalcProg *prog = calc_cache_get(cache, exprs[i], lits, err, sizeof(err));
+                if (prog) calc_run(prog, lits, 0, &r, err, sizeof(err));
+            } else calc_eval(&progs[i], 0, &r, err, sizeof(err));
+            sink = r;
+        }
+        count += 1000;
+        elapsed = now() - start;
+    } while (elapsed < secs);
+    calc_cache_free(cache);
+    return count / elapsed;
+}
+
+// level -1: calc_cache_get + calc_run per value, else calc_run_batch with
+// that level of kernels
+static double run_batch(const char *expr, int level, double secs) {
+    static double xs[BATCH_N], out[BATCH_N];
+    const CalcKernels *k = calc_kernels(level < 0 ? 0 : level);
+    CalcCache *cache = calc_cache_new(64);
+    char err[128];
+    double lits[CALC_MAX_CONSTS];
+    long count = 0;
+
+    for (int i = 0; i < BATCH_N; i++) xs[i] = 0.01 * (i + 1);
+    double start = now(), elapsed;
+    do {
+        if (level < 0) {
+            for (int i = 0; i < BATCH_N; i++) {
+                const CalcProg *prog = calc_cache_get(cache, expr, lits, err, sizeof(err));
+                if (prog) calc_run(prog, lits, xs[i], &out[i], err, sizeof(err));
+            }
+        } else {
+            const CalcProg *prog = calc_cache_get(cache, expr, lits, err, sizeof(err));
+            if (prog) calc_run_batch(prog, lits, k, xs, BATCH_N, out, err, sizeof(err));
+        }
+        sink = out[BATCH_N - 1];
+        count += BATCH_N;
+        elapsed = now() - start;
+    } while (elapsed < secs);
+    calc_cache_free(cache);
+    return count / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    double secs = argc > 1 ? atof(argv[1]) : 1;
+    if (secs <= 0) secs = 1;
+
+    printf("%-10s %16s %16s %16s %16s\n", "exprs", "old eval/s", "compile+eval/s", "cached/s", "eval only/s");
+    printf("%-10s %16.0f %16.0f %16.0f %16.0f\n", "simple",
+           run(simple, NSIMPLE, 0, secs), run(simple, NSIMPLE, 1, secs),
+           run(simple, NSIMPLE, 3, secs), run(simple, NSIMPLE, 2, secs));
+    printf("%-10s %16s %16.0f %16.0f %16.0f\n", "nested", "-",
+           run(nested, NNESTED, 1, secs), run(nested, NNESTED, 3, secs), run(nested, NNESTED, 2, secs));
+
+    printf("\nbatches of %d, values of x per second (best kernels here: %s)\n", BATCH_N, calc_kernels(-1)->name);
+    printf("%-28s %14s %14s %14s %14s\n", "expr", "per request", "batch scalar", "batch sse4.1", "batch avx2");
+    for (int i = 0; i < NBATCHED; i++) {
+        printf("%-28s %14.0f %14.0f", batched[i], run_batch(batched[i], -1, secs), run_batch(batched[i], CALC_SIMD_SCALAR, secs));
+        for (int level = CALC_SIMD_SSE; level <= CALC_SIMD_AVX2; level++) {
+            if (calc_kernels(level) == calc_kernels(level - 1)) printf(" %14s", "-");
+            else printf(" %14.0f", run_batch(batched[i], level, secs));
+        }
+        printf("\n");
+    }
+    return 0;
+}
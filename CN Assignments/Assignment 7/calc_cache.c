@@ -0,0 +1,143 @@
+// calc_cache.c
+// Chained hash table over a fixed array of entries, which also form a
+// doubly linked list in recency order; a miss on a full cache reuses the
+// least recently used entry.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "calc_cache.h"
+
+typedef struct {
+    char shape[CALC_MAX_SHAPE];
+    unsigned hash;
+    int chain;          // next entry in the same bucket, -1 at the end
+    int prev, next;     // recency list, most recent first
+    CalcProg prog;
+} Entry;
+
+struct CalcCache {
+    Entry *entries;
+    int *buckets;
+    unsigned mask;
+    int capacity, used;
+    int head, tail;
+    atomic_ulong hits, misses, evictions;   // read by calc_cache_stats() from any thread
+    atomic_int nentries;                    // used, for the same reader
+    CalcProg scratch;   // for shapes too long to cache
+};
+
+// Only the owning thread writes the counters, so a plain load and store
+// will do; relaxed atomics just keep a reader on another thread well defined.
+static void bump(atomic_ulong *n) {
+    atomic_store_explicit(n, atomic_load_explicit(n, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static unsigned hash_shape(const char *s) {
+    unsigned h = 2166136261u;   // FNV-1a
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+CalcCache *calc_cache_new(int capacity) {
+    if (capacity < 1) capacity = 1;
+    CalcCache *c = calloc(1, sizeof(CalcCache));
+    if (!c) return NULL;
+    unsigned nbuckets = 1;
+    while (nbuckets < 2u * capacity) nbuckets *= 2;
+    c->entries = malloc(capacity * sizeof(Entry));
+    c->buckets = malloc(nbuckets * sizeof(int));
+    if (!c->entries || !c->buckets) {
+        free(c->entries);
+        free(c->buckets);
+        free(c);
+        return NULL;
+    }
+    for (unsigned i = 0; i < nbuckets; i++) c->buckets[i] = -1;
+    c->mask = nbuckets - 1;
+    c->capacity = capacity;
+    c->head = c->tail = -1;
+    return c;
+}
+
+void calc_cache_free(CalcCache *c) {
+    if (!c) return;
+    free(c->entries);
+    free(c->buckets);
+    free(c);
+}
+
+static void list_unlink(CalcCache *c, int i) {
+    Entry *e = &c->entries[i];
+    if (e->prev >= 0) c->entries[e->prev].next = e->next; else c->head = e->next;
+    if (e->next >= 0) c->entries[e->next].prev = e->prev; else c->tail = e->prev;
+}
+
+static void list_push_front(CalcCache *c, int i) {
+    Entry *e = &c->entries[i];
+    e->prev = -1;
+    e->next = c->head;
+    if (c->head >= 0) c->entries[c->head].prev = i; else c->tail = i;
+    c->head = i;
+}
+
+static void chain_unlink(CalcCache *c, int i) {
+    int *link = &c->buckets[c->entries[i].hash & c->mask];
+    while (*link != i) link = &c->entries[*link].chain;
+    *link = c->entries[i].chain;
+}
+
+const CalcProg *calc_cache_get(CalcCache *c, const char *src, double *lits, char *err, size_t errlen) {
+    char shape[CALC_MAX_SHAPE];
+    int nlits = calc_shape(src, shape, sizeof(shape), lits);
+
+    if (nlits >= 0) {
+        unsigned h = hash_shape(shape);
+        for (int i = c->buckets[h & c->mask]; i >= 0; i = c->entries[i].chain) {
+            Entry *e = &c->entries[i];
+            if (e->hash == h && strcmp(e->shape, shape) == 0) {
+                bump(&c->hits);
+                if (c->head != i) {
+                    list_unlink(c, i);
+                    list_push_front(c, i);
+                }
+                return &e->prog;
+            }
+        }
+    }
+
+    bump(&c->misses);
+    if (!calc_compile(src, &c->scratch, err, errlen)) return NULL;
+    memcpy(lits, c->scratch.consts, c->scratch.nconsts * sizeof(double));
+    if (nlits < 0) return &c->scratch;
+
+    int i;
+    if (c->used < c->capacity) {
+        i = c->used++;
+        atomic_store_explicit(&c->nentries, c->used, memory_order_relaxed);
+    } else {
+        i = c->tail;
+        list_unlink(c, i);
+        chain_unlink(c, i);
+        bump(&c->evictions);
+    }
+    Entry *e = &c->entries[i];
+    strcpy(e->shape, shape);
+    e->hash = hash_shape(shape);
+    e->prog = c->scratch;
+    e->chain = c->buckets[e->hash & c->mask];
+    c->buckets[e->hash & c->mask] = i;
+    list_push_front(c, i);
+    return &e->prog;
+}
+
+void calc_cache_stats(const CalcCache *c, CalcCacheStats *st) {
+    st->hits = atomic_load_explicit(&c->hits, memory_order_relaxed);
+    st->misses = atomic_load_explicit(&c->misses, memory_order_relaxed);
+    st->evictions = atomic_load_explicit(&c->evictions, memory_order_relaxed);
+    st->entries = atomic_load_explicit(&c->nentries, memory_order_relaxed);
+    st->capacity = c->capacity;
+}
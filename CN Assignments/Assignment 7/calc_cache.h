@@ -0,0 +1,31 @@
+// calc_cache.h
+// Bounded LRU cache of compiled expressions, keyed by shape (calc_shape()):
+// "sin(0.5) * 2" and "sin(1.25) * 3" share one entry, and a hit costs one
+// lexer pass over the request instead of a parse. Not thread safe; give each
+// thread its own. Only calc_cache_stats() may be called from another thread.
+
+#ifndef CALC_CACHE_H
+#define CALC_CACHE_H
+
+#include "calc_expr.h"
+
+#define CALC_MAX_SHAPE 256      // longer shapes are compiled every time
+
+typedef struct {
+    unsigned long hits, misses, evictions;
+    int entries, capacity;
+} CalcCacheStats;
+
+typedef struct CalcCache CalcCache;
+
+CalcCache *calc_cache_new(int capacity);    // NULL if out of memory
+void calc_cache_free(CalcCache *c);
+
+// Program for src, compiled on a miss, with src's literals written to lits
+// (room for CALC_MAX_CONSTS) for calc_run(). Valid until the next call.
+// NULL with err set if src does not compile; failures are not cached.
+const CalcProg *calc_cache_get(CalcCache *c, const char *src, double *lits, char *err, size_t errlen);
+
+void calc_cache_stats(const CalcCache *c, CalcCacheStats *st);
+
+#endif
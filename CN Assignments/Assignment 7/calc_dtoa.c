@@ -0,0 +1,208 @@
+// calc_dtoa.c
+// Grisu2 after Milo Yip's dtoa (as used in RapidJSON): v's neighbours
+// v- and v+ (halfway to the adjacent doubles) are scaled by a cached power
+// of ten into 64-bit fixed point, then digits are generated from the upper
+// bound until the rest falls inside the rounding interval.
+
+#include <stdint.h>
+#include <string.h>
+#include "calc_dtoa.h"
+
+typedef struct { uint64_t f; int e; } DiyFp;   // f * 2^e
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT (1ull << SIGNIFICAND_BITS)
+#define EXPONENT_BIAS (0x3FF + SIGNIFICAND_BITS)
+
+// 10^k for k = -348, -340, ..., 340, normalized to 64 bits and rounded
+static const uint64_t pow10_f[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull, 0xcf42894a5dce35eaull,
+    0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull, 0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full,
+    0xbe5691ef416bd60cull, 0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull, 0xc21094364dfb5637ull,
+    0x9096ea6f3848984full, 0xd77485cb25823ac7ull, 0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull,
+    0xb23867fb2a35b28eull, 0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull, 0xb5b5ada8aaff80b8ull,
+    0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull, 0x964e858c91ba2655ull, 0xdff9772470297ebdull,
+    0xa6dfbd9fb8e5b88full, 0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull, 0xaa242499697392d3ull,
+    0xfd87b5f28300ca0eull, 0xbce5086492111aebull, 0x8cbccc096f5088ccull, 0xd1b71758e219652cull,
+    0x9c40000000000000ull, 0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull, 0x9f4f2726179a2245ull,
+    0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull, 0x83c7088e1aab65dbull, 0xc45d1df942711d9aull,
+    0x924d692ca61be758ull, 0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull, 0x952ab45cfa97a0b3ull,
+    0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull, 0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull,
+    0x88fcf317f22241e2ull, 0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull, 0x8bab8eefb6409c1aull,
+    0xd01fef10a657842cull, 0x9b10a4e5e9913129ull, 0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull,
+    0x80444b5e7aa7cf85ull, 0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+static const int16_t pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull,
+};
+
+static DiyFp diy_mul(DiyFp x, DiyFp y) {
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t h = (uint64_t)(p >> 64);
+    if ((uint64_t)p & (1ull << 63)) h++;    // round
+    return (DiyFp){ h, x.e + y.e + 64 };
+}
+
+static DiyFp diy_normalize(DiyFp x) {
+    int s = __builtin_clzll(x.f);
+    return (DiyFp){ x.f << s, x.e - s };
+}
+
+// Scaled v, v- and v+ share an exponent; v+ is normalized
+static void boundaries(uint64_t f, int e, DiyFp *minus, DiyFp *plus) {
+    DiyFp pl = diy_normalize((DiyFp){ (f << 1) + 1, e - 1 });
+    // The gap below a power of two is half the gap above it
+    DiyFp mi = f == HIDDEN_BIT ? (DiyFp){ (f << 2) - 1, e - 2 } : (DiyFp){ (f << 1) - 1, e - 1 };
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+// Cached power c = 10^-K with c * 2^e landing in [2^-60, 2^-32)
+static DiyFp cached_power(int e, int *K) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) k++;
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    return (DiyFp){ pow10_f[index], pow10_e[index] };
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_digits(uint32_t n) {
+    int d = 1;
+    while (d < 10 && n >= pow10_u64[d]) d++;
+    return d;
+}
+
+static int digit_gen(DiyFp w, DiyFp mp, uint64_t delta, char *buf, int *K) {
+    DiyFp one = { 1ull << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);   // integer part
+    uint64_t p2 = mp.f & (one.f - 1);           // fraction
+    int kappa = count_digits(p1), len = 0;
+
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+        p1 %= (uint32_t)pow10_u64[kappa - 1];
+        if (d || len) buf[len++] = (char)('0' + d);
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisu_round(buf, len, delta, rest, pow10_u64[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || len) buf[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round(buf, len, delta, p2, one.f, -kappa < 20 ? wp_w * pow10_u64[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+static char *write_exponent(int k, char *p) {
+    *p++ = 'e';
+    *p++ = k < 0 ? '-' : '+';
+    if (k < 0) k = -k;
+    if (k >= 100) { *p++ = (char)('0' + k / 100); k %= 100; }
+    *p++ = (char)('0' + k / 10);
+    *p++ = (char)('0' + k % 10);
+    return p;
+}
+
+int calc_dtoa(double v, char *buf) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    char *p = buf;
+    int biased = (int)(u >> 52 & 0x7FF);
+    uint64_t frac = u & (HIDDEN_BIT - 1);
+
+    if (u >> 63) *p++ = '-';
+    if (biased == 0x7FF) {
+        if (frac) { strcpy(buf, "nan"); return 3; }
+        strcpy(p, "inf");
+        return (int)(p - buf) + 3;
+    }
+    if (biased == 0 && frac == 0) { *p++ = '0'; *p = 0; return (int)(p - buf); }
+
+    uint64_t f = biased ? frac + HIDDEN_BIT : frac;
+    int e = biased ? biased - EXPONENT_BIAS : 1 - EXPONENT_BIAS;
+    DiyFp wm, wp;
+    boundaries(f, e, &wm, &wp);
+    int K;
+    DiyFp c = cached_power(wp.e, &K);
+    DiyFp w = diy_mul(diy_normalize((DiyFp){ f, e }), c);
+    wp = diy_mul(wp, c);
+    wm = diy_mul(wm, c);
+    wm.f++;     // stay strictly inside the interval, which the
+    wp.f--;     // rounding of the products could have widened
+    char digits[20];
+    int len = digit_gen(w, wp, wp.f - wm.f, digits, &K);
+
+    int exp10 = len + K - 1;    // v = d.ddd * 10^exp10
+    if (exp10 < -5 || exp10 > 16) {
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        p = write_exponent(exp10, p);
+    } else if (exp10 < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > exp10; i--) *p++ = '0';
+        memcpy(p, digits, len);
+        p += len;
+    } else if (len <= exp10 + 1) {
+        memcpy(p, digits, len);
+        p += len;
+        for (int i = len; i <= exp10; i++) *p++ = '0';
+    } else {
+        memcpy(p, digits, exp10 + 1);
+        p += exp10 + 1;
+        *p++ = '.';
+        memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+        p += len - exp10 - 1;
+    }
+    *p = 0;
+    return (int)(p - buf);
+}
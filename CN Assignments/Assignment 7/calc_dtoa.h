@@ -0,0 +1,19 @@
+// calc_dtoa.h
+// Double to decimal text for calculator replies: the shortest digit string
+// that reads back (strtod) as the same double, found with Grisu2
+// (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers", 2010). Grisu2 always round-trips and is shortest for all but
+// a fraction of a percent of inputs, where it gives one digit more.
+//
+// Layout follows %g: plain notation for exponents -5..16 ("0.0001", "12.5",
+// "1234567"), otherwise "1.5e+20" / "-2e-07"; "inf", "-inf", "nan".
+
+#ifndef CALC_DTOA_H
+#define CALC_DTOA_H
+
+#define CALC_DTOA_MAX 32    // buffer size that fits any result
+
+// Writes v to buf with a terminating 0, returns its length (at most 24)
+int calc_dtoa(double v, char *buf);
+
+#endif
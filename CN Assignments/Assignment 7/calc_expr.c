@@ -0,0 +1,383 @@
+// calc_expr.c
+// See calc_expr.h for the grammar.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include "calc_expr.h"
+
+enum {
+    OP_END,
+    OP_CONST,   // + u8 index into consts
+    OP_NAMED,   // + u8 index into named (kept out of consts, which are the literals)
+    OP_X,
+    OP_NEG,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW,
+    OP_SQRT,    // checked: negative argument is an error
+    OP_INV,     // checked: 1/0 is an error
+    OP_FN1,     // + u8 index into fn1
+    OP_FN2      // + u8 index into fn2
+};
+
+static const struct { const char *name; double v; } named[] = {
+    {"pi", M_PI}, {"e", M_E},
+};
+
+static const struct { const char *name; double (*f)(double); } fn1[] = {
+    {"sin", sin}, {"cos", cos}, {"tan", tan},
+    {"asin", asin}, {"acos", acos}, {"atan", atan},
+    {"sinh", sinh}, {"cosh", cosh}, {"tanh", tanh},
+    {"exp", exp}, {"ln", log}, {"log", log10}, {"cbrt", cbrt},
+    {"abs", fabs}, {"floor", floor}, {"ceil", ceil}, {"round", round},
+};
+
+static const struct { const char *name; double (*f)(double, double); } fn2[] = {
+    {"pow", pow}, {"min", fmin}, {"max", fmax}, {"hypot", hypot},
+};
+
+#define NFN1 (int)(sizeof(fn1) / sizeof(fn1[0]))
+#define NFN2 (int)(sizeof(fn2) / sizeof(fn2[0]))
+#define NNAMED (int)(sizeof(named) / sizeof(named[0]))
+
+enum { T_END, T_NUM, T_NAME, T_BAD };
+
+typedef struct {
+    const char *s;          // next unread character
+    int tok;                // T_* or the operator character
+    double num;
+    char name[16];
+    CalcProg *prog;
+    int depth, sp;
+    char *err;
+    size_t errlen;
+    int failed;
+} Parser;
+
+static void fail(Parser *p, const char *msg) {
+    if (!p->failed) snprintf(p->err, p->errlen, "%s", msg);
+    p->failed = 1;
+}
+
+// Plain decimals with at most 15 significant digits convert exactly as
+// digits / 10^k (both exact doubles, one correctly rounded division), which
+// is much cheaper than strtod. Returns NULL for anything else.
+static const char *fast_decimal(const char *s, double *out) {
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                                    1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    uint64_t m = 0;
+    int digits = 0, frac = -1;
+    for (;; s++) {
+        if (*s >= '0' && *s <= '9') {
+            m = m * 10 + (uint64_t)(*s - '0');
+            if (m && ++digits > 15) return NULL;
+            if (frac >= 0) frac++;
+        } else if (*s == '.' && frac < 0) {
+            frac = 0;
+        } else {
+            break;
+        }
+    }
+    if (*s == 'e' || *s == 'E' || *s == 'x' || *s == 'X' || frac > 15) return NULL;
+    *out = frac > 0 ? (double)m / pow10[frac] : (double)m;
+    return s;
+}
+
+static void next(Parser *p) {
+    while (isspace((unsigned char)*p->s)) p->s++;
+    char c = *p->s;
+    if (c == 0) { p->tok = T_END; return; }
+    if (isdigit((unsigned char)c) || c == '.') {
+        const char *end = fast_decimal(p->s, &p->num);
+        if (!end) {
+            char *e;
+            p->num = strtod(p->s, &e);
+            end = e;
+        }
+        if (end == p->s || (end == p->s + 1 && *p->s == '.')) { p->tok = T_BAD; return; }
+        p->s = end;
+        p->tok = T_NUM;
+        return;
+    }
+    if (isalpha((unsigned char)c)) {
+        // Letters only, so "sin1.57" still reads as sin 1.57
+        int n = 0;
+        while (isalpha((unsigned char)*p->s)) {
+            if (n < (int)sizeof(p->name) - 1) p->name[n++] = tolower((unsigned char)*p->s);
+            p->s++;
+        }
+        p->name[n] = 0;
+        p->tok = T_NAME;
+        return;
+    }
+    if (strchr("+-*/^(),", c)) { p->s++; p->tok = c; return; }
+    p->tok = T_BAD;
+}
+
+static void emit(Parser *p, int op, int push) {
+    CalcProg *g = p->prog;
+    if (g->ncode >= CALC_MAX_CODE - 1) { fail(p, "expression too long"); return; }
+    g->code[g->ncode++] = (uint8_t)op;
+    p->sp += push;
+    if (p->sp > CALC_MAX_STACK) fail(p, "expression too complex");
+}
+
+static void emit_arg(Parser *p, int arg) {
+    CalcProg *g = p->prog;
+    if (g->ncode >= CALC_MAX_CODE - 1) { fail(p, "expression too long"); return; }
+    g->code[g->ncode++] = (uint8_t)arg;
+}
+
+static void expect(Parser *p, int tok, const char *msg) {
+    if (p->tok != tok) { fail(p, msg); return; }
+    next(p);
+}
+
+static void parse_expr(Parser *p);
+static void parse_unary(Parser *p);
+
+static void push_literal(Parser *p, double v) {
+    CalcProg *g = p->prog;
+    if (g->nconsts >= CALC_MAX_CONSTS) { fail(p, "too many numbers"); return; }
+    g->consts[g->nconsts] = v;
+    emit(p, OP_CONST, 1);
+    emit_arg(p, g->nconsts++);
+}
+
+static void parse_call(Parser *p, const char *name) {
+    int f1 = -1, f2 = -1;
+    int special = strcmp(name, "sqrt") == 0 ? OP_SQRT : strcmp(name, "inv") == 0 ? OP_INV : 0;
+    for (int i = 0; i < NFN1 && !special; i++) if (strcmp(name, fn1[i].name) == 0) f1 = i;
+    for (int i = 0; i < NFN2; i++) if (strcmp(name, fn2[i].name) == 0) f2 = i;
+    if (!special && f1 < 0 && f2 < 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "unknown function '%s'", name);
+        fail(p, msg);
+        return;
+    }
+
+    if (f2 >= 0) {
+        expect(p, '(', "expected '(' after function name");
+        parse_expr(p);
+        expect(p, ',', "expected ',' between arguments");
+        parse_expr(p);
+        expect(p, ')', "missing ')'");
+        emit(p, OP_FN2, -1);
+        emit_arg(p, f2);
+        return;
+    }
+
+    // "sin(x)" parses the parenthesised expr as the argument; "sin 1.57" a unary
+    parse_unary(p);
+    if (special) emit(p, special, 0);
+    else { emit(p, OP_FN1, 0); emit_arg(p, f1); }
+}
+
+static void parse_atom(Parser *p) {
+    if (p->failed) return;
+    if (p->tok == T_NUM) {
+        push_literal(p, p->num);
+        next(p);
+    } else if (p->tok == '(') {
+        next(p);
+        parse_expr(p);
+        expect(p, ')', "missing ')'");
+    } else if (p->tok == T_NAME) {
+        char name[16];
+        strcpy(name, p->name);
+        next(p);
+        if (strcmp(name, "x") == 0) { emit(p, OP_X, 1); p->prog->uses_x = 1; return; }
+        for (int i = 0; i < NNAMED; i++) {
+            if (strcmp(name, named[i].name) == 0) { emit(p, OP_NAMED, 1); emit_arg(p, i); return; }
+        }
+        parse_call(p, name);
+    } else if (p->tok == T_END) {
+        fail(p, "unexpected end of expression");
+    } else {
+        fail(p, "unexpected character");
+    }
+}
+
+static void parse_unary(Parser *p) {
+    if (p->failed) return;
+    if (++p->depth > CALC_MAX_DEPTH) { fail(p, "expression nested too deeply"); return; }
+    if (p->tok == '-' || p->tok == '+') {
+        int neg = p->tok == '-';
+        next(p);
+        parse_unary(p);
+        if (neg) emit(p, OP_NEG, 0);
+    } else {
+        parse_atom(p);
+        if (p->tok == '^') {
+            next(p);
+            parse_unary(p);
+            emit(p, OP_POW, -1);
+        }
+    }
+    p->depth--;
+}
+
+static void parse_term(Parser *p) {
+    parse_unary(p);
+    while (!p->failed && (p->tok == '*' || p->tok == '/')) {
+        int op = p->tok == '*' ? OP_MUL : OP_DIV;
+        next(p);
+        parse_unary(p);
+        emit(p, op, -1);
+    }
+}
+
+static void parse_expr(Parser *p) {
+    if (++p->depth > CALC_MAX_DEPTH) { fail(p, "expression nested too deeply"); return; }
+    parse_term(p);
+    while (!p->failed && (p->tok == '+' || p->tok == '-')) {
+        int op = p->tok == '+' ? OP_ADD : OP_SUB;
+        next(p);
+        parse_term(p);
+        emit(p, op, -1);
+    }
+    p->depth--;
+}
+
+int calc_compile(const char *src, CalcProg *prog, char *err, size_t errlen) {
+    Parser p = { .s = src, .prog = prog, .err = err, .errlen = errlen };
+    prog->ncode = prog->nconsts = prog->uses_x = 0;
+    next(&p);
+    parse_expr(&p);
+    if (!p.failed && p.tok != T_END) fail(&p, p.tok == ')' ? "unmatched ')'" : "unexpected input after expression");
+    emit(&p, OP_END, 0);
+    return !p.failed;
+}
+
+int calc_shape(const char *src, char *shape, size_t n, double *lits) {
+    Parser p = { .s = src };
+    size_t len = 0;
+    int nlits = 0;
+
+    for (next(&p); p.tok != T_END; next(&p)) {
+        const char *piece;
+        char op[2] = { (char)p.tok, 0 };
+        if (p.tok == T_BAD) return -1;
+        if (p.tok == T_NUM) {
+            if (nlits >= CALC_MAX_CONSTS) return -1;
+            lits[nlits++] = p.num;
+            piece = "#";
+        } else if (p.tok == T_NAME) {
+            piece = p.name;
+        } else {
+            piece = op;
+        }
+        size_t k = strlen(piece);
+        if (len + k + 2 > n) return -1;
+        memcpy(shape + len, piece, k);
+        len += k;
+        if (p.tok == T_NAME) shape[len++] = ' ';  // keeps "sin x" apart from "sinx"
+    }
+    shape[len] = 0;
+    return nlits;
+}
+
+int calc_eval(const CalcProg *prog, double x, double *res, char *err, size_t errlen) {
+    return calc_run(prog, prog->consts, x, res, err, errlen);
+}
+
+int calc_run(const CalcProg *prog, const double *consts, double x, double *res, char *err, size_t errlen) {
+    double st[CALC_MAX_STACK];
+    int sp = 0;
+    const uint8_t *pc = prog->code;
+
+    while (1) {
+        switch (*pc++) {
+        case OP_END: *res = st[0]; return 1;
+        case OP_CONST: st[sp++] = consts[*pc++]; break;
+        case OP_NAMED: st[sp++] = named[*pc++].v; break;
+        case OP_X: st[sp++] = x; break;
+        case OP_NEG: st[sp - 1] = -st[sp - 1]; break;
+        case OP_ADD: sp--; st[sp - 1] += st[sp]; break;
+        case OP_SUB: sp--; st[sp - 1] -= st[sp]; break;
+        case OP_MUL: sp--; st[sp - 1] *= st[sp]; break;
+        case OP_DIV:
+            sp--;
+            if (st[sp] == 0) { snprintf(err, errlen, "divide by zero"); return 0; }
+            st[sp - 1] /= st[sp];
+            break;
+        case OP_POW: sp--; st[sp - 1] = pow(st[sp - 1], st[sp]); break;
+        case OP_SQRT:
+            if (st[sp - 1] < 0) { snprintf(err, errlen, "sqrt of negative"); return 0; }
+            st[sp - 1] = sqrt(st[sp - 1]);
+            break;
+        case OP_INV:
+            if (st[sp - 1] == 0) { snprintf(err, errlen, "divide by zero"); return 0; }
+            st[sp - 1] = 1.0 / st[sp - 1];
+            break;
+        case OP_FN1: st[sp - 1] = fn1[*pc++].f(st[sp - 1]); break;
+        case OP_FN2: sp--; st[sp - 1] = fn2[*pc].f(st[sp - 1], st[sp]); pc++; break;
+        default: snprintf(err, errlen, "bad program"); return 0;
+        }
+    }
+}
+
+static void fill(double *a, int n, double v) {
+    for (int i = 0; i < n; i++) a[i] = v;
+}
+
+int calc_run_batch(const CalcProg *prog, const double *consts, const CalcKernels *k,
+                   const double *xs, int n, double *out, char *err, size_t errlen) {
+    double st[CALC_MAX_STACK][CALC_BATCH_BLOCK];
+
+    for (int base = 0; base < n; base += CALC_BATCH_BLOCK) {
+        int m = n - base < CALC_BATCH_BLOCK ? n - base : CALC_BATCH_BLOCK;
+        const double *x = xs + base;
+        const uint8_t *pc = prog->code;
+        int sp = 0, bad = 0, done = 0;
+
+        while (!done) {
+            double *top = st[sp > 0 ? sp - 1 : 0];
+            switch (*pc++) {
+            case OP_END: memcpy(out + base, st[0], m * sizeof(double)); done = 1; break;
+            case OP_CONST: fill(st[sp++], m, consts[*pc++]); break;
+            case OP_NAMED: fill(st[sp++], m, named[*pc++].v); break;
+            case OP_X: memcpy(st[sp++], x, m * sizeof(double)); break;
+            case OP_NEG: for (int i = 0; i < m; i++) top[i] = -top[i]; break;
+            case OP_ADD: sp--; k->add(st[sp - 1], st[sp], m); break;
+            case OP_SUB: sp--; k->sub(st[sp - 1], st[sp], m); break;
+            case OP_MUL: sp--; k->mul(st[sp - 1], st[sp], m); break;
+            case OP_DIV: sp--; bad |= k->div(st[sp - 1], st[sp], m); break;
+            case OP_POW:
+                sp--;
+                for (int i = 0; i < m; i++) st[sp - 1][i] = pow(st[sp - 1][i], st[sp][i]);
+                break;
+            case OP_SQRT: bad |= k->sqrt(top, m); break;
+            case OP_INV: bad |= k->inv(top, m); break;
+            case OP_FN1: {
+                double (*f)(double) = fn1[*pc++].f;
+                if (f == sin) k->sin(top, m);
+                else if (f == cos) k->cos(top, m);
+                else for (int i = 0; i < m; i++) top[i] = f(top[i]);
+                break;
+            }
+            case OP_FN2: {
+                double (*f)(double, double) = fn2[*pc++].f;
+                sp--;
+                for (int i = 0; i < m; i++) st[sp - 1][i] = f(st[sp - 1][i], st[sp][i]);
+                break;
+            }
+            default: snprintf(err, errlen, "bad program"); return 0;
+            }
+        }
+
+        // A kernel saw a bad operand somewhere in the block: rerun it one
+        // element at a time to find which, and why
+        for (int i = 0; bad && i < m; i++) {
+            double r;
+            char why[64];
+            if (!calc_run(prog, consts, x[i], &r, why, sizeof(why))) {
+                snprintf(err, errlen, "%s at element %d", why, base + i);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,67 @@
+// calc_expr.h
+// Expression compiler for the UDP calculator: tokenizer + recursive-descent
+// parser emitting a small stack bytecode, and an evaluator for it.
+//
+// Grammar (names are case-insensitive):
+//   expr  := term (('+' | '-') term)*
+//   term  := unary (('*' | '/') unary)*
+//   unary := ('-' | '+') unary | power
+//   power := atom ('^' unary)?                     right associative
+//   atom  := number | 'x' | 'pi' | 'e' | '(' expr ')'
+//          | func '(' expr [',' expr] ')'
+//          | func unary                            old style: "sin 1.57"
+// Functions: sin cos tan asin acos atan sinh cosh tanh exp ln log (base 10)
+// sqrt cbrt abs floor ceil round inv (1/x), and pow min max hypot of two.
+//
+// Neither compiling nor evaluating allocates: a CalcProg is a fixed-size
+// value, and evaluation uses a stack array. Numeric literals (only those,
+// not pi or e) go into consts[] in the order they appear in the source, so
+// a program can be re-run with other literals by replacing consts[].
+
+#ifndef CALC_EXPR_H
+#define CALC_EXPR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "calc_simd.h"
+
+#define CALC_MAX_CODE 256
+#define CALC_MAX_CONSTS 64
+#define CALC_MAX_STACK 32
+#define CALC_MAX_DEPTH 32
+#define CALC_BATCH_BLOCK 128    // elements per pass of calc_run_batch()
+
+typedef struct {
+    uint8_t code[CALC_MAX_CODE];
+    int ncode;
+    double consts[CALC_MAX_CONSTS];
+    int nconsts;
+    int uses_x;
+} CalcProg;
+
+// Returns 1 on success, else 0 with a message in err
+int calc_compile(const char *src, CalcProg *prog, char *err, size_t errlen);
+
+// Runs prog with the given value of x. Returns 1 with the value in *res, or
+// 0 with a message in err (divide by zero, sqrt of negative).
+int calc_eval(const CalcProg *prog, double x, double *res, char *err, size_t errlen);
+// Same, with the literals taken from consts instead of prog->consts
+int calc_run(const CalcProg *prog, const double *consts, double x, double *res, char *err, size_t errlen);
+
+// Runs prog once per element of xs[0..n-1] into out, one block of
+// CALC_BATCH_BLOCK elements at a time: every opcode works across the whole
+// block, with add/sub/mul/div/sqrt/inv/sin/cos done by the kernels k
+// (calc_kernels()) and the rest by libm per element. Returns 1, or 0 with
+// err naming the first element (counting from 0) that calc_run() would
+// reject, e.g. "divide by zero at element 17".
+int calc_run_batch(const CalcProg *prog, const double *consts, const CalcKernels *k,
+                   const double *xs, int n, double *out, char *err, size_t errlen);
+
+// The token sequence of src with every literal replaced by '#', e.g.
+// "sin(1.5) * 2" -> "sin (#)*#", with the literals stored in lits (room
+// for CALC_MAX_CONSTS). Two sources with the same shape compile to the same
+// code, differing only in consts. Returns the number of literals, or -1 if
+// src has a character no expression can contain or shape would exceed n.
+int calc_shape(const char *src, char *shape, size_t n, double *lits);
+
+#endif
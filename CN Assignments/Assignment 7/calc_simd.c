@@ -0,0 +1,320 @@
+// calc_simd.c
+// The SIMD versions are compiled with target attributes, so the file
+// needs no -mavx2 and the program still runs on CPUs without it. They are
+// built without FMA on purpose: fused multiply-adds would round
+// differently from the C version.
+
+#include <math.h>
+#include "calc_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// Cephes sin/cos: x reduced by multiples of pi/4 (subtracted in three
+// parts, exact for |x| up to ~1e9), then one of two degree-13/14 polynomials
+#define DP1 7.85398125648498535156e-1
+#define DP2 3.77489470793079817668e-8
+#define DP3 2.69515142907905952645e-15
+#define FOUR_OVER_PI 1.27323954473516268615
+#define REDUCE_MAX 1e8
+
+static const double sincof[] = {
+    1.58962301576546568060e-10, -2.50507477628578072866e-8, 2.75573136213857245213e-6,
+    -1.98412698295895385996e-4, 8.33333333332211858878e-3, -1.66666666666666307295e-1,
+};
+static const double coscof[] = {
+    -1.13585365213876817300e-11, 2.08757008419747316778e-9, -2.75573141792967388112e-7,
+    2.48015872888517045348e-5, -1.38888888888730564116e-3, 4.16666666666665929218e-2,
+};
+
+static double sincos1(double x, int want_cos) {
+    if (!(fabs(x) <= REDUCE_MAX)) return want_cos ? cos(x) : sin(x);
+
+    double sign = !want_cos && signbit(x) ? -1 : 1;
+    double ax = fabs(x);
+    double y = floor(ax * FOUR_OVER_PI);
+    double j = y - 8 * floor(y * 0.125);        // octant, mod 8
+    if (j - 2 * floor(j * 0.5) == 1) { j += 1; y += 1; }
+    if (j == 8) j = 0;
+    if (j > 3) { sign = -sign; j -= 4; }
+    if (want_cos && j == 2) sign = -sign;
+
+    double z = ((ax - y * DP1) - y * DP2) - y * DP3;
+    double zz = z * z;
+    double ps = sincof[0], pc = coscof[0];
+    for (int k = 1; k < 6; k++) {
+        ps = ps * zz + sincof[k];
+        pc = pc * zz + coscof[k];
+    }
+    ps = z + z * (zz * ps);
+    pc = (1.0 - 0.5 * zz) + zz * zz * pc;
+    return sign * ((j == 2) != want_cos ? pc : ps);
+}
+
+// Plain C
+
+static void add_c(double *a, const double *b, int n) { for (int i = 0; i < n; i++) a[i] += b[i]; }
+static void sub_c(double *a, const double *b, int n) { for (int i = 0; i < n; i++) a[i] -= b[i]; }
+static void mul_c(double *a, const double *b, int n) { for (int i = 0; i < n; i++) a[i] *= b[i]; }
+
+static int div_c(double *a, const double *b, int n) {
+    int bad = 0;
+    for (int i = 0; i < n; i++) { bad |= b[i] == 0; a[i] /= b[i]; }
+    return bad;
+}
+
+static int sqrt_c(double *a, int n) {
+    int bad = 0;
+    for (int i = 0; i < n; i++) { bad |= a[i] < 0; a[i] = sqrt(a[i]); }
+    return bad;
+}
+
+static int inv_c(double *a, int n) {
+    int bad = 0;
+    for (int i = 0; i < n; i++) { bad |= a[i] == 0; a[i] = 1.0 / a[i]; }
+    return bad;
+}
+
+static void sin_c(double *a, int n) { for (int i = 0; i < n; i++) a[i] = sincos1(a[i], 0); }
+static void cos_c(double *a, int n) { for (int i = 0; i < n; i++) a[i] = sincos1(a[i], 1); }
+
+static const CalcKernels scalar_kernels = {
+    "scalar", add_c, sub_c, mul_c, div_c, sqrt_c, inv_c, sin_c, cos_c
+};
+
+#ifdef HAVE_X86
+
+// AVX2: 4 doubles per step, C for the tail
+
+#define AVX __attribute__((target("avx2")))
+
+AVX static void add_avx2(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    add_c(a + i, b + i, n - i);
+}
+
+AVX static void sub_avx2(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    sub_c(a + i, b + i, n - i);
+}
+
+AVX static void mul_avx2(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mul_c(a + i, b + i, n - i);
+}
+
+AVX static int div_avx2(double *a, const double *b, int n) {
+    __m256d bad = _mm256_setzero_pd(), zero = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_loadu_pd(b + i);
+        bad = _mm256_or_pd(bad, _mm256_cmp_pd(d, zero, _CMP_EQ_OQ));
+        _mm256_storeu_pd(a + i, _mm256_div_pd(_mm256_loadu_pd(a + i), d));
+    }
+    return div_c(a + i, b + i, n - i) | (_mm256_movemask_pd(bad) != 0);
+}
+
+AVX static int sqrt_avx2(double *a, int n) {
+    __m256d bad = _mm256_setzero_pd(), zero = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(a + i);
+        bad = _mm256_or_pd(bad, _mm256_cmp_pd(v, zero, _CMP_LT_OQ));
+        _mm256_storeu_pd(a + i, _mm256_sqrt_pd(v));
+    }
+    return sqrt_c(a + i, n - i) | (_mm256_movemask_pd(bad) != 0);
+}
+
+AVX static int inv_avx2(double *a, int n) {
+    __m256d bad = _mm256_setzero_pd(), zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(a + i);
+        bad = _mm256_or_pd(bad, _mm256_cmp_pd(v, zero, _CMP_EQ_OQ));
+        _mm256_storeu_pd(a + i, _mm256_div_pd(one, v));
+    }
+    return inv_c(a + i, n - i) | (_mm256_movemask_pd(bad) != 0);
+}
+
+AVX static __m256d floor_avx2(__m256d v) { return _mm256_round_pd(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+
+// sincos1() four lanes at a time, with blends in place of the branches
+AVX static void sincos_avx2(double *a, int n, int want_cos) {
+    const __m256d signbit = _mm256_set1_pd(-0.0), one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+    const __m256d three = _mm256_set1_pd(3.0), four = _mm256_set1_pd(4.0), eight = _mm256_set1_pd(8.0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d ax = _mm256_andnot_pd(signbit, x);
+        __m256d sign = want_cos ? _mm256_setzero_pd() : _mm256_and_pd(x, signbit);
+        __m256d y = floor_avx2(_mm256_mul_pd(ax, _mm256_set1_pd(FOUR_OVER_PI)));
+        __m256d j = _mm256_sub_pd(y, _mm256_mul_pd(eight, floor_avx2(_mm256_mul_pd(y, _mm256_set1_pd(0.125)))));
+        __m256d odd = _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(j, _mm256_mul_pd(two, floor_avx2(_mm256_mul_pd(j, _mm256_set1_pd(0.5))))),
+                                                  one, _CMP_EQ_OQ), one);
+        j = _mm256_add_pd(j, odd);
+        y = _mm256_add_pd(y, odd);
+        j = _mm256_andnot_pd(_mm256_cmp_pd(j, eight, _CMP_EQ_OQ), j);
+        __m256d gt3 = _mm256_cmp_pd(j, three, _CMP_GT_OQ);
+        sign = _mm256_xor_pd(sign, _mm256_and_pd(gt3, signbit));
+        j = _mm256_sub_pd(j, _mm256_and_pd(gt3, four));
+        __m256d is2 = _mm256_cmp_pd(j, two, _CMP_EQ_OQ);
+        if (want_cos) sign = _mm256_xor_pd(sign, _mm256_and_pd(is2, signbit));
+
+        __m256d z = _mm256_sub_pd(_mm256_sub_pd(_mm256_sub_pd(ax, _mm256_mul_pd(y, _mm256_set1_pd(DP1))),
+                                                _mm256_mul_pd(y, _mm256_set1_pd(DP2))),
+                                  _mm256_mul_pd(y, _mm256_set1_pd(DP3)));
+        __m256d zz = _mm256_mul_pd(z, z);
+        __m256d ps = _mm256_set1_pd(sincof[0]), pc = _mm256_set1_pd(coscof[0]);
+        for (int k = 1; k < 6; k++) {
+            ps = _mm256_add_pd(_mm256_mul_pd(ps, zz), _mm256_set1_pd(sincof[k]));
+            pc = _mm256_add_pd(_mm256_mul_pd(pc, zz), _mm256_set1_pd(coscof[k]));
+        }
+        ps = _mm256_add_pd(z, _mm256_mul_pd(z, _mm256_mul_pd(zz, ps)));
+        pc = _mm256_add_pd(_mm256_sub_pd(one, _mm256_mul_pd(_mm256_set1_pd(0.5), zz)), _mm256_mul_pd(_mm256_mul_pd(zz, zz), pc));
+        __m256d r = want_cos ? _mm256_blendv_pd(pc, ps, is2) : _mm256_blendv_pd(ps, pc, is2);
+        _mm256_storeu_pd(a + i, _mm256_xor_pd(r, sign));
+
+        // Lanes too large to reduce, inf or NaN
+        int bad = _mm256_movemask_pd(_mm256_cmp_pd(ax, _mm256_set1_pd(REDUCE_MAX), _CMP_NLE_UQ));
+        if (bad) {
+            double in[4];
+            _mm256_storeu_pd(in, x);
+            for (int k = 0; k < 4; k++) if (bad >> k & 1) a[i + k] = want_cos ? cos(in[k]) : sin(in[k]);
+        }
+    }
+    for (; i < n; i++) a[i] = sincos1(a[i], want_cos);
+}
+
+AVX static void sin_avx2(double *a, int n) { sincos_avx2(a, n, 0); }
+AVX static void cos_avx2(double *a, int n) { sincos_avx2(a, n, 1); }
+
+static const CalcKernels avx2_kernels = {
+    "avx2", add_avx2, sub_avx2, mul_avx2, div_avx2, sqrt_avx2, inv_avx2, sin_avx2, cos_avx2
+};
+
+// SSE4.1: 2 doubles per step (SSE2 has no floor or blend)
+
+#define SSE __attribute__((target("sse4.1")))
+
+SSE static void add_sse(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    add_c(a + i, b + i, n - i);
+}
+
+SSE static void sub_sse(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    sub_c(a + i, b + i, n - i);
+}
+
+SSE static void mul_sse(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mul_c(a + i, b + i, n - i);
+}
+
+SSE static int div_sse(double *a, const double *b, int n) {
+    __m128d bad = _mm_setzero_pd(), zero = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d d = _mm_loadu_pd(b + i);
+        bad = _mm_or_pd(bad, _mm_cmpeq_pd(d, zero));
+        _mm_storeu_pd(a + i, _mm_div_pd(_mm_loadu_pd(a + i), d));
+    }
+    return div_c(a + i, b + i, n - i) | (_mm_movemask_pd(bad) != 0);
+}
+
+SSE static int sqrt_sse(double *a, int n) {
+    __m128d bad = _mm_setzero_pd(), zero = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(a + i);
+        bad = _mm_or_pd(bad, _mm_cmplt_pd(v, zero));
+        _mm_storeu_pd(a + i, _mm_sqrt_pd(v));
+    }
+    return sqrt_c(a + i, n - i) | (_mm_movemask_pd(bad) != 0);
+}
+
+SSE static int inv_sse(double *a, int n) {
+    __m128d bad = _mm_setzero_pd(), zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(a + i);
+        bad = _mm_or_pd(bad, _mm_cmpeq_pd(v, zero));
+        _mm_storeu_pd(a + i, _mm_div_pd(one, v));
+    }
+    return inv_c(a + i, n - i) | (_mm_movemask_pd(bad) != 0);
+}
+
+SSE static void sincos_sse(double *a, int n, int want_cos) {
+    const __m128d signbit = _mm_set1_pd(-0.0), one = _mm_set1_pd(1.0), two = _mm_set1_pd(2.0);
+    const __m128d three = _mm_set1_pd(3.0), four = _mm_set1_pd(4.0), eight = _mm_set1_pd(8.0);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d ax = _mm_andnot_pd(signbit, x);
+        __m128d sign = want_cos ? _mm_setzero_pd() : _mm_and_pd(x, signbit);
+        __m128d y = _mm_floor_pd(_mm_mul_pd(ax, _mm_set1_pd(FOUR_OVER_PI)));
+        __m128d j = _mm_sub_pd(y, _mm_mul_pd(eight, _mm_floor_pd(_mm_mul_pd(y, _mm_set1_pd(0.125)))));
+        __m128d odd = _mm_and_pd(_mm_cmpeq_pd(_mm_sub_pd(j, _mm_mul_pd(two, _mm_floor_pd(_mm_mul_pd(j, _mm_set1_pd(0.5))))),
+                                              one), one);
+        j = _mm_add_pd(j, odd);
+        y = _mm_add_pd(y, odd);
+        j = _mm_andnot_pd(_mm_cmpeq_pd(j, eight), j);
+        __m128d gt3 = _mm_cmpgt_pd(j, three);
+        sign = _mm_xor_pd(sign, _mm_and_pd(gt3, signbit));
+        j = _mm_sub_pd(j, _mm_and_pd(gt3, four));
+        __m128d is2 = _mm_cmpeq_pd(j, two);
+        if (want_cos) sign = _mm_xor_pd(sign, _mm_and_pd(is2, signbit));
+
+        __m128d z = _mm_sub_pd(_mm_sub_pd(_mm_sub_pd(ax, _mm_mul_pd(y, _mm_set1_pd(DP1))),
+                                          _mm_mul_pd(y, _mm_set1_pd(DP2))),
+                               _mm_mul_pd(y, _mm_set1_pd(DP3)));
+        __m128d zz = _mm_mul_pd(z, z);
+        __m128d ps = _mm_set1_pd(sincof[0]), pc = _mm_set1_pd(coscof[0]);
+        for (int k = 1; k < 6; k++) {
+            ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(sincof[k]));
+            pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(coscof[k]));
+        }
+        ps = _mm_add_pd(z, _mm_mul_pd(z, _mm_mul_pd(zz, ps)));
+        pc = _mm_add_pd(_mm_sub_pd(one, _mm_mul_pd(_mm_set1_pd(0.5), zz)), _mm_mul_pd(_mm_mul_pd(zz, zz), pc));
+        __m128d r = want_cos ? _mm_blendv_pd(pc, ps, is2) : _mm_blendv_pd(ps, pc, is2);
+        _mm_storeu_pd(a + i, _mm_xor_pd(r, sign));
+
+        int bad = _mm_movemask_pd(_mm_cmpnle_pd(ax, _mm_set1_pd(REDUCE_MAX)));
+        if (bad) {
+            double in[2];
+            _mm_storeu_pd(in, x);
+            for (int k = 0; k < 2; k++) if (bad >> k & 1) a[i + k] = want_cos ? cos(in[k]) : sin(in[k]);
+        }
+    }
+    for (; i < n; i++) a[i] = sincos1(a[i], want_cos);
+}
+
+SSE static void sin_sse(double *a, int n) { sincos_sse(a, n, 0); }
+SSE static void cos_sse(double *a, int n) { sincos_sse(a, n, 1); }
+
+static const CalcKernels sse_kernels = {
+    "sse4.1", add_sse, sub_sse, mul_sse, div_sse, sqrt_sse, inv_sse, sin_sse, cos_sse
+};
+
+#endif
+
+const CalcKernels *calc_kernels(int level) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2"), sse = __builtin_cpu_supports("sse4.1");
+    if (level < 0) level = avx2 ? CALC_SIMD_AVX2 : sse ? CALC_SIMD_SSE : CALC_SIMD_SCALAR;
+    if (level == CALC_SIMD_AVX2 && avx2) return &avx2_kernels;
+    if (level >= CALC_SIMD_SSE && sse) return &sse_kernels;
+#else
+    (void)level;
+#endif
+    return &scalar_kernels;
+}
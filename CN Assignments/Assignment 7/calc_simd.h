@@ -0,0 +1,31 @@
+// calc_simd.h
+// Array kernels for batch evaluation (calc_run_batch): a[i] = a[i] op b[i]
+// over n elements, in AVX2, SSE4.1 and plain C versions. The best one the
+// CPU supports is picked at startup (x86-64 only; elsewhere always C).
+//
+// sin/cos use Cephes' range reduction and polynomials in every version, so
+// all three agree to the last bit; inputs beyond +-1e8, inf and NaN fall
+// back to libm.
+
+#ifndef CALC_SIMD_H
+#define CALC_SIMD_H
+
+enum { CALC_SIMD_SCALAR, CALC_SIMD_SSE, CALC_SIMD_AVX2 };
+
+typedef struct {
+    const char *name;
+    void (*add)(double *a, const double *b, int n);
+    void (*sub)(double *a, const double *b, int n);
+    void (*mul)(double *a, const double *b, int n);
+    int (*div)(double *a, const double *b, int n);     // 1 if some b[i] == 0
+    int (*sqrt)(double *a, int n);                     // 1 if some a[i] < 0
+    int (*inv)(double *a, int n);                      // 1 if some a[i] == 0
+    void (*sin)(double *a, int n);
+    void (*cos)(double *a, int n);
+} CalcKernels;
+
+// Kernels for level, or for the best level available if level is -1 or
+// not supported by this CPU
+const CalcKernels *calc_kernels(int level);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef CALC_WIRE_H
+#define CALC_WIRE_H
+
+// Binary datagram format for the UDP calculator, next to the text one
+// ("ID|expression[|x]"). A datagram whose first byte is CW_MAGIC is binary;
+// text IDs are printable, so the server can tell them apart per request.
+// Integers are big-endian and doubles are sent as their raw IEEE-754 bits
+// (also big-endian), so results keep full precision.
+//
+//   request:  u8 magic | u8 op     | u16 n | u32 handle | u64 id | body
+//   reply:    u8 magic | u8 status | u16 n | u32 handle | u64 id | body
+//
+//   CW_COMPILE  body: n bytes of expression text
+//               -> CS_OK with the program's handle, empty body
+//   CW_RUN      handle from CW_COMPILE, body: n f64 values of x (n = 0 runs
+//               once for an expression without x)
+//               -> CS_OK, body: one f64 result per run
+//   CW_ADD..    body: the op's 1 or 2 f64 operands -> CS_OK, body: f64 result
+//
+// Failures: CS_ERR with an n byte message as body, CS_BAD_REQUEST for a
+// malformed request, and CS_BAD_HANDLE when the server no longer has (or
+// never had) the program: compile again. Replies other than to CW_COMPILE
+// echo the request's handle, so a client can tell a bounce of its current
+// handle from one of a handle it has already replaced. Handles belong to
+// the server worker that compiled them, which keeps receiving the same
+// client.
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define CW_MAGIC 0xCA
+#define CW_HDR 16
+#define CW_MAX_VALUES 8000      // f64s per datagram: 8000 * 8 + CW_HDR < 65507
+
+enum {
+    CW_COMPILE = 1,
+    CW_RUN,
+    CW_ADD = 0x10, CW_SUB, CW_MUL, CW_DIV, CW_POW,                          // a op b
+    CW_NEG = 0x20, CW_SQRT, CW_INV, CW_SIN, CW_COS, CW_TAN, CW_EXP, CW_LN   // op a
+};
+
+enum { CS_OK, CS_ERR, CS_BAD_HANDLE, CS_BAD_REQUEST };
+
+static inline void cw_put_f64(char *p, double v) {
+    uint64_t u;
+    memcpy(&u, &v, 8);
+    u = htobe64(u);
+    memcpy(p, &u, 8);
+}
+
+static inline double cw_get_f64(const char *p) {
+    uint64_t u;
+    double v;
+    memcpy(&u, p, 8);
+    u = be64toh(u);
+    memcpy(&v, &u, 8);
+    return v;
+}
+
+// Writes a header; the body follows at dst + CW_HDR
+static inline void cw_header(char *dst, uint8_t op, uint16_t n, uint32_t handle, uint64_t id) {
+    dst[0] = (char)CW_MAGIC;
+    dst[1] = (char)op;
+    n = htobe16(n);
+    handle = htobe32(handle);
+    id = htobe64(id);
+    memcpy(dst + 2, &n, 2);
+    memcpy(dst + 4, &handle, 4);
+    memcpy(dst + 8, &id, 8);
+}
+
+// Reads the header of a datagram of len bytes. Returns 0 if it is too
+// short or not binary.
+static inline int cw_parse(const char *buf, size_t len, uint8_t *op, uint16_t *n, uint32_t *handle, uint64_t *id) {
+    if (len < CW_HDR || (uint8_t)buf[0] != CW_MAGIC) return 0;
+    *op = (uint8_t)buf[1];
+    memcpy(n, buf + 2, 2);
+    memcpy(handle, buf + 4, 4);
+    memcpy(id, buf + 8, 8);
+    *n = be16toh(*n);
+    *handle = be32toh(*handle);
+    *id = be64toh(*id);
+    return 1;
+}
+
+#endif
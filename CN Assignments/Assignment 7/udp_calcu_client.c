@@ -1,20 +1,43 @@
 // udp_calc_client.c
 // Compile: gcc udp_calc_client.c -o udp_calc_client
-// Run: ./udp_calc_client <server_ip> <server_port>
+// Run: ./udp_calc_client <server_ip> <server_port> [-n count [-w window] [-e expr] [-r retries] [-b]]
 // Example: ./udp_calc_client 10.0.0.1 8080
+//
+// With -n the client is not interactive: it sends count copies of expr
+// (default "sin(x)*2 + sqrt(3/4)|0.5"), each under its own ID, keeping up
+// to window (default 64) unanswered at once. A request unanswered after
+// its timeout is sent again, up to retries (default MAX_RETRIES) times, and
+// then counted lost. The timeout adapts to the measured round trip the way
+// TCP's does (RFC 6298). At the end it reports loss, retransmits,
+// reordering and the latency distribution. -b uses the binary format
+// (calc_wire.h): the expression is compiled once and every request carries
+// only its handle and the values of x as raw doubles. If the server loses
+// the program, the first bounce of that handle compiles it again while the
+// replies still in flight keep being counted.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <time.h>
+#include "../common/latency_hist.h"
+#include "calc_wire.h"
 
 #define BUF 1024
+#define REPLY_BUF 65536     // batch replies can fill a datagram
 #define TIMEOUT_SEC 2
 #define MAX_RETRIES 3
 
+#define DEFAULT_WINDOW 64
+#define ASYNC_BATCH 64          // datagrams per sendmmsg/recvmmsg
+#define RTO_INIT_US 1000000.0   // until the first sample
+#define RTO_MIN_US 1000.0       // the server answers at once, so no 200 ms floor as in TCP
+#define RTO_MAX_US (TIMEOUT_SEC * 1000000.0)
+
 // helper: generate a simple unique id (timestamp + counter)
 char *make_id(char *buf, size_t n) {
     static int ctr = 0;
@@ -24,9 +47,277 @@ char *make_id(char *buf, size_t n) {
     return buf;
 }
 
+// Retransmission timeout after Jacobson/Karels: smoothed RTT plus four
+// mean deviations. Only requests answered on their first send are sampled
+// (Karn), since a retransmitted one's reply could be for either copy.
+typedef struct { double srtt, rttvar, rto; int sampled; } RttEst;   // us
+
+void rtt_sample(RttEst *e, double r) {
+    if (!e->sampled) {
+        e->srtt = r;
+        e->rttvar = r / 2;
+        e->sampled = 1;
+    } else {
+        e->rttvar = 0.75 * e->rttvar + 0.25 * (e->srtt > r ? e->srtt - r : r - e->srtt);
+        e->srtt = 0.875 * e->srtt + 0.125 * r;
+    }
+    e->rto = e->srtt + 4 * e->rttvar;
+    if (e->rto < RTO_MIN_US) e->rto = RTO_MIN_US;
+    if (e->rto > RTO_MAX_US) e->rto = RTO_MAX_US;
+}
+
+// A request in flight
+typedef struct {
+    long req;           // index of the request, -1 if the slot is free
+    int tries;          // retransmits so far
+    int bounced;        // CS_BAD_HANDLE: resend at once, not counted as a retransmit
+    uint64_t first_ns, sent_ns, deadline;
+} Slot;
+
+// Pipelined mode (-n): see the top of the file. sock is connected.
+int pipelined(int sock, const char *expr, long count, int window, int retries, int binary) {
+    Slot *slots = malloc(window * sizeof(Slot));
+    int *free_slots = malloc(window * sizeof(int)), nfree = window;
+    int *slot_of = malloc(count * sizeof(int));        // -1 once answered or lost
+    char (*out_buf)[BUF] = malloc(ASYNC_BATCH * sizeof(*out_buf));
+    char (*in_buf)[REPLY_BUF] = malloc(ASYNC_BATCH * sizeof(*in_buf));
+    if (!slots || !free_slots || !slot_of || !out_buf || !in_buf) { printf("Out of memory\n"); return 1; }
+    for (int i = 0; i < window; i++) { slots[i].req = -1; free_slots[i] = i; }
+    for (long i = 0; i < count; i++) slot_of[i] = -1;
+
+    // Every request is its own ID (or binary header) in out_buf followed
+    // by the same body: the text after "ID|", or the values of x
+    char *body = (char *)expr;
+    size_t body_len = strlen(expr);
+    uint32_t handle = 0;
+    uint16_t nx = 0;
+    // CW_COMPILE goes out with ID 0 whenever there is no valid handle; no
+    // request is sent meanwhile
+    char text[BUF], compile_req[BUF];
+    int compile_len = 0, compiling = 0, compile_tries = 0;
+    uint64_t compile_deadline = 0;
+    if (binary) {
+        snprintf(text, sizeof(text), "%s", expr);
+        char *xval = strchr(text, '|');
+        if (xval) *xval++ = 0;
+        int tlen = strlen(text);
+        if (tlen > BUF - CW_HDR) { printf("Expression too long\n"); return 1; }
+        cw_header(compile_req, CW_COMPILE, tlen, 0, 0);
+        memcpy(compile_req + CW_HDR, text, tlen);
+        compile_len = CW_HDR + tlen;
+        compiling = 1;
+        body = malloc(CW_MAX_VALUES * 8);
+        if (!body) { printf("Out of memory\n"); return 1; }
+        for (char *p = xval, *end; p && nx < CW_MAX_VALUES; p = end) {
+            while (*p == ' ' || *p == ',') p++;
+            double v = strtod(p, &end);
+            if (end == p) break;
+            cw_put_f64(body + 8 * nx++, v);
+        }
+        body_len = 8 * nx;
+    }
+
+    struct iovec out_iov[ASYNC_BATCH][2], in_iov[ASYNC_BATCH];
+    struct mmsghdr out[ASYNC_BATCH], in[ASYNC_BATCH];
+    memset(out, 0, sizeof(out));
+    memset(in, 0, sizeof(in));
+    for (int i = 0; i < ASYNC_BATCH; i++) {
+        out_iov[i][0].iov_base = out_buf[i];
+        out_iov[i][1].iov_base = body;
+        out_iov[i][1].iov_len = body_len;
+        out[i].msg_hdr.msg_iov = out_iov[i];
+        out[i].msg_hdr.msg_iovlen = 2;
+        in_iov[i].iov_base = in_buf[i];
+        in_iov[i].iov_len = REPLY_BUF - 1;
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // IDs are base + request index; base keeps a previous run's late
+    // replies from matching
+    unsigned long long base = ((unsigned long long)time(NULL) % 100000 + 1) * 1000000000ull;
+    long next = 0, done = 0, answered = 0, errors = 0, lost = 0, retransmits = 0, recompiles = 0;
+    long late = 0, reordered = 0, highest = -1;
+    RttEst est = { 0, 0, RTO_INIT_US, 0 };
+    LatencyHist hist;
+    hist_init(&hist);
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    uint64_t start = now_ns();
+
+    while (done < count) {
+        uint64_t now = now_ns(), wake = UINT64_MAX;
+        int nout = 0;
+
+        if (compiling) {
+            if (compile_deadline <= now) {
+                if (compile_tries++ > retries) {
+                    printf("No reply to compile after %d retries\n", retries);
+                    return 1;
+                }
+                if (send(sock, compile_req, compile_len, 0) < 0) { perror("send"); return 1; }
+                compile_deadline = now + TIMEOUT_SEC * 1000000000ull;
+            }
+            wake = compile_deadline;
+        }
+
+        // Resend or give up on requests whose timeout passed, then fill the
+        // window with new ones
+        for (int i = 0; !compiling && (i < window || (nfree > 0 && next < count)); i++) {
+            Slot *sl;
+            if (i < window) {
+                sl = &slots[i];
+                if (sl->req < 0 || (!sl->bounced && sl->deadline > now)) {
+                    if (sl->req >= 0 && sl->deadline < wake) wake = sl->deadline;
+                    continue;
+                }
+                if (sl->bounced) {
+                    // The server answered it, so this is a new send, not a
+                    // retransmit: tries and backoff stay as they are
+                    sl->bounced = 0;
+                } else if (sl->tries == retries) {
+                    slot_of[sl->req] = -1;
+                    sl->req = -1;
+                    free_slots[nfree++] = i;
+                    lost++;
+                    done++;
+                    continue;
+                } else {
+                    sl->tries++;
+                    retransmits++;
+                }
+            } else {
+                int k = free_slots[--nfree];
+                sl = &slots[k];
+                sl->req = next;
+                sl->tries = 0;
+                sl->bounced = 0;
+                sl->first_ns = now;
+                slot_of[next++] = k;
+            }
+            double rto = est.rto * (1 << sl->tries);     // back off per retransmit
+            sl->sent_ns = now;
+            sl->deadline = now + (uint64_t)((rto < RTO_MAX_US ? rto : RTO_MAX_US) * 1000);
+            if (sl->deadline < wake) wake = sl->deadline;
+            if (binary) {
+                cw_header(out_buf[nout], CW_RUN, nx, handle, base + sl->req);
+                out_iov[nout][0].iov_len = CW_HDR;
+            } else {
+                out_iov[nout][0].iov_len = sprintf(out_buf[nout], "%llu|", base + sl->req);
+            }
+            if (++nout == ASYNC_BATCH) {
+                sendmmsg(sock, out, nout, 0);   // a dropped send is a loss like any other
+                nout = 0;
+            }
+        }
+        if (nout > 0) sendmmsg(sock, out, nout, 0);
+        if (done == count) break;
+
+        // Wait for replies until the earliest timeout
+        now = now_ns();
+        struct timespec ts = { 0, 0 };
+        if (wake > now) { ts.tv_sec = (wake - now) / 1000000000; ts.tv_nsec = (wake - now) % 1000000000; }
+        if (ppoll(&pfd, 1, &ts, NULL) <= 0) continue;
+
+        int n = recvmmsg(sock, in, ASYNC_BATCH, MSG_DONTWAIT, NULL);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            // expect ID|OK|result  OR ID|ERR|errmsg, or a binary reply
+            char *reply = in_buf[i];
+            reply[in[i].msg_len] = 0;
+            unsigned long long id;
+            int ok;
+            uint8_t status = CS_BAD_REQUEST;
+            uint32_t h = 0;
+            if (binary) {
+                uint16_t len;
+                uint64_t id64;
+                ok = cw_parse(reply, in[i].msg_len, &status, &len, &h, &id64);
+                id = id64;
+            } else {
+                char *end;
+                id = strtoull(reply, &end, 10);
+                ok = *end == '|';
+                if (ok && strncmp(end + 1, "OK|", 3) == 0) status = CS_OK;
+            }
+            if (binary && ok && id == 0) {
+                // Reply to CW_COMPILE; a duplicate after the handle is in is late
+                if (!compiling) { late++; continue; }
+                if (status != CS_OK) {
+                    printf("Compile failed: %.*s\n", (int)(in[i].msg_len - CW_HDR), reply + CW_HDR);
+                    return 1;
+                }
+                handle = h;
+                compiling = 0;
+                compile_tries = 0;
+                compile_deadline = 0;
+                continue;
+            }
+            long req = (long)(id - base);
+            if (!ok || id < base || req >= count || slot_of[req] < 0) { late++; continue; }
+
+            int k = slot_of[req];
+            Slot *sl = &slots[k];
+            if (status == CS_BAD_HANDLE) {
+                // The server lost the program (restart, eviction). Only a
+                // bounce of the current handle compiles again; every bounced
+                // request is resent once the new handle is in
+                if (h == handle && !compiling) {
+                    compiling = 1;
+                    compile_deadline = 0;
+                    recompiles++;
+                }
+                sl->bounced = 1;
+                continue;
+            }
+            if (sl->tries == 0) rtt_sample(&est, (now - sl->sent_ns) / 1e3);
+            hist_record(&hist, now - sl->first_ns);
+            if (status != CS_OK) errors++;
+            if (req < highest) reordered++; else highest = req;
+            slot_of[req] = -1;
+            sl->req = -1;
+            free_slots[nfree++] = k;
+            answered++;
+            done++;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%ld requests, window %d: %ld answered (%ld errors), %ld lost (%.3f%%), %.0f req/s\n",
+           count, window, answered, errors, lost, 100.0 * lost / count, answered / elapsed);
+    printf("retransmits %ld, late or duplicate replies %ld, reordered %ld (%.3f%%)%s",
+           retransmits, late, reordered, answered ? 100.0 * reordered / answered : 0.0, binary ? "" : "\n");
+    if (binary) printf(", recompiles %ld\n", recompiles);
+    printf("rtt us: srtt %.1f  rttvar %.1f  rto %.1f\n", est.srtt, est.rttvar, est.rto);
+    if (hist.total > 0) {
+        printf("latency us: mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n\n",
+               hist.sum / hist.total / 1e3, hist_quantile(&hist, 0.5) / 1e3, hist_quantile(&hist, 0.99) / 1e3,
+               hist_quantile(&hist, 0.999) / 1e3, hist.max / 1e3);
+        hist_print(&hist, stdout);
+    }
+    return lost > 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) { printf("Usage: %s <server_ip> <server_port>\n", argv[0]); return 1; }
+    if (argc < 3) {
+        printf("Usage: %s <server_ip> <server_port> [-n count [-w window] [-e expr] [-r retries] [-b]]\n", argv[0]);
+        return 1;
+    }
     char *ip = argv[1]; int port = atoi(argv[2]);
+    long count = 0;
+    int window = DEFAULT_WINDOW, retries = MAX_RETRIES, binary = 0, opt;
+    const char *expr = "sin(x)*2 + sqrt(3/4)|0.5";
+    optind = 3;
+    while ((opt = getopt(argc, argv, "n:w:e:r:b")) != -1) {
+        if (opt == 'n') count = atol(optarg);
+        else if (opt == 'w') window = atoi(optarg);
+        else if (opt == 'e') expr = optarg;
+        else if (opt == 'r') retries = atoi(optarg);
+        else if (opt == 'b') binary = 1;
+        else return 1;
+    }
+    if (window < 1) window = 1;
+    if (retries < 0) retries = 0;
+    if (retries > 16) retries = 16;
 
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) { perror("socket"); return 1; }
@@ -37,12 +328,19 @@ int main(int argc, char *argv[]) {
     serv.sin_port = htons(port);
     inet_pton(AF_INET, ip, &serv.sin_addr);
 
+    if (count > 0) {
+        if (connect(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("connect"); return 1; }
+        return pipelined(sock, expr, count, window, retries, binary);
+    }
+
     // set recv timeout
     struct timeval tv; tv.tv_sec = TIMEOUT_SEC; tv.tv_usec = 0;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 
-    char line[512];
+    char line[BUF];
     printf("UDP Calculator client. Type expressions like: sin 1.57   or   3 * 4  or  inv 2\n");
+    printf("or (sin(x) + 1) * sqrt(2) | 0.5   to give x a value,\n");
+    printf("or sin(x) | 0 0.5 1 1.5   for one result per value.\n");
     printf("Type QUIT to exit.\n");
 
     while (1) {
@@ -54,7 +352,10 @@ int main(int argc, char *argv[]) {
         if (strcasecmp(line, "QUIT")==0) break;
         char id[64]; make_id(id, sizeof(id));
         char sendbuf[BUF];
-        snprintf(sendbuf, sizeof(sendbuf), "%s|%s", id, line);
+        if (snprintf(sendbuf, sizeof(sendbuf), "%s|%s", id, line) >= (int)sizeof(sendbuf)) {
+            printf("Expression too long\n");
+            continue;
+        }
 
         int tries = 0;
         int got = 0;
@@ -62,7 +363,7 @@ int main(int argc, char *argv[]) {
             ssize_t s = sendto(sock, sendbuf, strlen(sendbuf), 0, (struct sockaddr*)&serv, sizeof(serv));
             if (s < 0) { perror("sendto"); break; }
             // wait for reply
-            char recvbuf[BUF];
+            static char recvbuf[REPLY_BUF];
             ssize_t r = recvfrom(sock, recvbuf, sizeof(recvbuf)-1, 0, NULL, NULL);
             if (r < 0) {
                 tries++;
@@ -71,15 +372,16 @@ int main(int argc, char *argv[]) {
             }
             recvbuf[r]=0;
             // expect ID|OK|result  OR ID|ERR|errmsg
-            char rid[64]; char status[16]; char payload[512];
+            // payload points into recvbuf: batch results can fill a datagram
+            char rid[64]; char status[16];
             char *pipe1 = strchr(recvbuf, '|');
-            if (!pipe1) { printf("Malformed reply: %s\n", recvbuf); got=1; break; }
-            int L1 = pipe1 - recvbuf; strncpy(rid, recvbuf, L1); rid[L1]=0;
-            char *rest = pipe1 + 1;
-            char *pipe2 = strchr(rest, '|');
-            if (!pipe2) { printf("Malformed reply: %s\n", recvbuf); got=1; break; }
-            int L2 = pipe2 - rest; strncpy(status, rest, L2); status[L2]=0;
-            strncpy(payload, pipe2+1, sizeof(payload)-1); payload[sizeof(payload)-1]=0;
+            char *pipe2 = pipe1 ? strchr(pipe1 + 1, '|') : NULL;
+            if (!pipe2 || pipe1 - recvbuf >= (int)sizeof(rid) || pipe2 - pipe1 - 1 >= (int)sizeof(status)) {
+                printf("Malformed reply: %s\n", recvbuf); got=1; break;
+            }
+            int L1 = pipe1 - recvbuf; memcpy(rid, recvbuf, L1); rid[L1]=0;
+            int L2 = pipe2 - pipe1 - 1; memcpy(status, pipe1 + 1, L2); status[L2]=0;
+            const char *payload = pipe2 + 1;
 
             if (strcmp(rid, id) != 0) {
                 // reply for different tx (rare), ignore and keep waiting
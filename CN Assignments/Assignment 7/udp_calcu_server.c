@@ -1,16 +1,68 @@
 // udp_calc_server.c
-// Compile: gcc udp_calc_server.c -o udp_calc_server -lm
-// Run: sudo ./udp_calc_server <port>
+// Compile: gcc udp_calcu_server.c calc_expr.c calc_cache.c calc_simd.c calc_dtoa.c -o udp_calc_server -lm -pthread
+// Run: sudo ./udp_calc_server <port> [cache_entries] [workers]
+// Requests are ID|expression or ID|expression|x, e.g. "7|sin(x)*2 + sqrt(3/4)|0.5".
+// Compiled expressions are cached by shape (calc_cache.h); ID|STATS reports
+// the hits, misses and evictions of all the workers' caches together.
+// A batch request gives several values of x, separated by spaces or commas:
+// "8|sin(x)|0 0.5 1 1.5" answers "8|OK|0 0.479425538604203 0.8414709848078965 0.9974949866040544".
+// Batches run through calc_run_batch() with the SIMD kernels (calc_simd.h).
+//
+// There is one worker per CPU unless [workers] says otherwise. Each has
+// its own SO_REUSEPORT socket, CPU and cache of cache_entries, and takes
+// up to BATCH datagrams per recvmmsg and answers them with one sendmmsg.
+// The kernel hashes a client's address to one socket, so a client's
+// requests always go to the same worker. Results are
+// printed as the shortest decimal that reads back as the same double
+// (calc_dtoa.h).
+//
+// Requests may also use the binary format in calc_wire.h, chosen per
+// datagram by its first byte: raw doubles both ways, and expressions
+// compiled once (CW_COMPILE) and then run by handle.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "calc_cache.h"
+#include "calc_dtoa.h"
+#include "calc_wire.h"
 
-#define BUF 1024
+#define BUF 65536           // largest UDP payload, rounded up
+#define DEFAULT_CACHE 1024
+#define CALC_BATCH_MAX 2500 // 2500 results of up to 25 chars fill a datagram
+#define BATCH 32            // datagrams per recvmmsg
+#define HANDLE_SLOTS 1024   // compiled programs kept per worker for CW_RUN
+
+// A program compiled by CW_COMPILE. Handles are handed out in sequence and
+// slot = handle % HANDLE_SLOTS, so the oldest program makes room.
+typedef struct {
+    uint32_t handle;
+    CalcProg prog;
+} Compiled;
+
+typedef struct {
+    int index, sock, cpu;
+    CalcCache *cache;
+    double batch_x[CW_MAX_VALUES], batch_res[CW_MAX_VALUES];
+    Compiled compiled[HANDLE_SLOTS];
+    uint32_t next_handle;
+    char in_buf[BATCH][BUF], out_buf[BATCH][BUF];
+    struct sockaddr_in addrs[BATCH];
+    struct iovec in_iov[BATCH], out_iov[BATCH];
+    struct mmsghdr in[BATCH], out[BATCH];
+} Worker;
+
+const CalcKernels *kern;
+Worker **workers;   // all of them, for STATS
+int nworkers;
 
 // Trim leading/trailing whitespace
 char *trim(char *s) {
@@ -20,155 +72,283 @@ char *trim(char *s) {
     return s;
 }
 
-int parse_double(const char *s, double *out) {
-    char *end;
-    double v = strtod(s, &end);
-    if (end==s) return 0;
-    *out = v;
-    return 1;
+// Evaluate expression (see calc_expr.h for what is accepted), with the
+// value of x if the request gave one. Returns 1 if ok and result in res,
+// else 0 with errmsg.
+int eval_expr(CalcCache *cache, const char *expr, const char *xval, double *res, char *errmsg, size_t emsglen) {
+    double lits[CALC_MAX_CONSTS], x = 0;
+    const CalcProg *prog = calc_cache_get(cache, expr, lits, errmsg, emsglen);
+    if (!prog) return 0;
+    if (prog->uses_x) {
+        char *end;
+        if (!xval) { snprintf(errmsg, emsglen, "x has no value"); return 0; }
+        x = strtod(xval, &end);
+        if (end == xval) { snprintf(errmsg, emsglen, "bad value for x"); return 0; }
+    }
+    return calc_run(prog, lits, x, res, errmsg, emsglen);
+}
+
+// Values of x in a batch request, separated by spaces or commas. Returns
+// how many, -1 if one is not a number, or -2 if there are more than max.
+int parse_batch(const char *s, double *xs, int max) {
+    int n = 0;
+    while (1) {
+        while (*s == ' ' || *s == ',' || *s == '\t' || *s == '\n') s++;
+        if (!*s) return n;
+        char *end;
+        double v = strtod(s, &end);
+        if (end == s) return -1;
+        if (n == max) return -2;
+        xs[n++] = v;
+        s = end;
+    }
 }
 
-int starts_with(const char *s, const char *p) {
-    return strncasecmp(s, p, strlen(p))==0;
+// Evaluate expr once per value in xs into out. Returns 1 if ok, else 0
+// with errmsg.
+int eval_batch(CalcCache *cache, const char *expr, const double *xs, int n, double *out, char *errmsg, size_t emsglen) {
+    double lits[CALC_MAX_CONSTS];
+    const CalcProg *prog = calc_cache_get(cache, expr, lits, errmsg, emsglen);
+    if (!prog) return 0;
+    return calc_run_batch(prog, lits, kern, xs, n, out, errmsg, emsglen);
 }
 
-// Evaluate expression. Returns 1 if ok and result in res, else 0 with errmsg.
-int eval_expr(const char *expr, double *res, char *errmsg, size_t emsglen) {
-    char tmp[BUF];
-    strncpy(tmp, expr, sizeof(tmp)-1); tmp[sizeof(tmp)-1]=0;
-    char *s = trim(tmp);
-
-    // unary functions: sin x  OR sin(x)
-    if (starts_with(s, "sin")) {
-        char *arg = s + 3;
-        if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
-        arg = trim(arg);
-        double x;
-        if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to sin"); return 0; }
-        *res = sin(x); return 1;
-    }
-    if (starts_with(s, "cos")) {
-        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
-        arg = trim(arg);
-        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to cos"); return 0; }
-        *res = cos(x); return 1;
-    }
-    if (starts_with(s, "tan")) {
-        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
-        arg = trim(arg);
-        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to tan"); return 0; }
-        *res = tan(x); return 1;
+// Answer the request in buf (NUL-terminated, modified) into out, which has
+// room for BUF bytes. Returns the reply's length.
+int handle_request(Worker *w, char *buf, char *out) {
+    // Expect messages: ID|expression[|x]
+    char *pipe = strchr(buf, '|');
+    if (!pipe) return snprintf(out, BUF, "0|ERR|malformed request");
+    int idlen = pipe - buf;
+    if (idlen > 63) idlen = 63;
+    buf[idlen] = 0;
+    const char *id = buf;
+    char *expr = pipe + 1;
+    char *xval = strchr(expr, '|');
+    if (xval) *xval++ = 0;
+    char *e = trim(expr);
+    char errmsg[128];
+
+    if (strcasecmp(e, "STATS") == 0) {
+        // Summed over every worker's cache, each read as it is right now
+        CalcCacheStats st = {0}, one;
+        for (int i = 0; i < nworkers; i++) {
+            calc_cache_stats(workers[i]->cache, &one);
+            st.hits += one.hits;
+            st.misses += one.misses;
+            st.evictions += one.evictions;
+            st.entries += one.entries;
+            st.capacity += one.capacity;
+        }
+        unsigned long lookups = st.hits + st.misses;
+        return snprintf(out, BUF, "%s|OK|workers=%d hits=%lu misses=%lu hit_rate=%.1f%% evictions=%lu entries=%d/%d",
+                        id, nworkers, st.hits, st.misses, lookups ? 100.0 * st.hits / lookups : 0.0,
+                        st.evictions, st.entries, st.capacity);
     }
-    if (starts_with(s, "inv")) { // inv x  => 1/x
-        char *arg = s + 3; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
-        arg = trim(arg);
-        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to inv"); return 0; }
-        if (x == 0) { snprintf(errmsg, emsglen, "divide by zero"); return 0; }
-        *res = 1.0/x; return 1;
+
+    double result;
+    int nx = xval ? parse_batch(xval, w->batch_x, CALC_BATCH_MAX) : 0;
+    if (nx < 0) {
+        if (nx == -1) return snprintf(out, BUF, "%s|ERR|bad value for x", id);
+        return snprintf(out, BUF, "%s|ERR|batch too large (at most %d values)", id, CALC_BATCH_MAX);
     }
-    if (starts_with(s, "sqrt")) {
-        char *arg = s + 4; if (*arg == '(') { arg++; char *p = strchr(arg, ')'); if (p) *p=0; }
-        arg = trim(arg);
-        double x; if (!parse_double(arg, &x)) { snprintf(errmsg, emsglen, "bad arg to sqrt"); return 0; }
-        if (x < 0) { snprintf(errmsg, emsglen, "sqrt of negative"); return 0; }
-        *res = sqrt(x); return 1;
+    if (nx > 1 ? !eval_batch(w->cache, e, w->batch_x, nx, w->batch_res, errmsg, sizeof(errmsg))
+               : !eval_expr(w->cache, e, xval, &result, errmsg, sizeof(errmsg)))
+        return snprintf(out, BUF, "%s|ERR|%s", id, errmsg);
+
+    // send ID|OK|<result> or ID|OK|<r1> <r2> ...
+    memcpy(out, id, idlen);
+    memcpy(out + idlen, "|OK|", 4);
+    int len = idlen + 4;
+    if (nx <= 1) return len + calc_dtoa(result, out + len);
+    for (int i = 0; i < nx; i++) {
+        if (i) out[len++] = ' ';
+        len += calc_dtoa(w->batch_res[i], out + len);
     }
+    return len;
+}
 
-    // binary operations: try to find + - * /
-    // locate operator (left->right preferred for +,-,* ,/)
-    char *op = NULL;
-    char *plus = strchr(s, '+');
-    char *minus = strchr(s, '-');
-    char *mul = strchr(s, '*');
-    char *divi = strchr(s, '/');
-
-    // prefer first-occurring operator (but handle negative numbers by checking position)
-    // find operator that is not first char (to avoid unary minus)
-    char *candidates[] = {plus, minus, mul, divi};
-    char ops[] = {'+', '-', '*', '/'};
-    for (int i=0;i<4;i++) {
-        char *p = candidates[i];
-        if (p && p != s) { op = p; break; }
+// Status-only or error reply to a binary request; handle echoes the request's
+int binary_error(char *out, uint8_t status, uint32_t handle, uint64_t id, const char *msg) {
+    int n = strlen(msg);
+    cw_header(out, status, n, handle, id);
+    memcpy(out + CW_HDR, msg, n);
+    return CW_HDR + n;
+}
+
+// Answer the binary request of len bytes in buf (calc_wire.h) into out.
+// Returns the reply's length.
+int handle_binary(Worker *w, char *buf, int len, char *out) {
+    uint8_t op;
+    uint16_t n;
+    uint32_t handle;
+    uint64_t id;
+    char errmsg[128];
+    const char *body = buf + CW_HDR;
+    if (!cw_parse(buf, len, &op, &n, &handle, &id)) return binary_error(out, CS_BAD_REQUEST, 0, 0, "short request");
+    int nbody = len - CW_HDR;
+
+    if (op == CW_COMPILE) {
+        if (n != nbody) return binary_error(out, CS_BAD_REQUEST, 0, id, "length mismatch");
+        buf[len] = 0;
+        if (++w->next_handle == 0) w->next_handle++;    // 0 is never a handle
+        handle = w->next_handle;
+        Compiled *c = &w->compiled[handle % HANDLE_SLOTS];
+        if (!calc_compile(body, &c->prog, errmsg, sizeof(errmsg))) {
+            c->handle = 0;
+            return binary_error(out, CS_ERR, 0, id, errmsg);
+        }
+        c->handle = handle;
+        cw_header(out, CS_OK, 0, handle, id);
+        return CW_HDR;
     }
 
-    if (op) {
-        char left[256], right[256];
-        strncpy(left, s, op - s);
-        left[op - s] = 0;
-        strcpy(right, op+1);
-        char *L = trim(left);
-        char *R = trim(right);
-        double a,b;
-        if (!parse_double(L, &a)) { snprintf(errmsg, emsglen, "bad left operand"); return 0; }
-        if (!parse_double(R, &b)) { snprintf(errmsg, emsglen, "bad right operand"); return 0; }
-        switch(*op) {
-            case '+': *res = a + b; return 1;
-            case '-': *res = a - b; return 1;
-            case '*': *res = a * b; return 1;
-            case '/': if (b==0) { snprintf(errmsg, emsglen, "divide by zero"); return 0; } *res = a / b; return 1;
+    if (nbody != 8 * n || n > CW_MAX_VALUES) return binary_error(out, CS_BAD_REQUEST, handle, id, "length mismatch");
+    for (int i = 0; i < n; i++) w->batch_x[i] = cw_get_f64(body + 8 * i);
+    double *x = w->batch_x, *res = w->batch_res;
+    int nres = 1, ok = 1;
+
+    if (op == CW_RUN) {
+        Compiled *c = &w->compiled[handle % HANDLE_SLOTS];
+        if (handle == 0 || c->handle != handle) return binary_error(out, CS_BAD_HANDLE, handle, id, "unknown handle");
+        if (n == 0 && c->prog.uses_x) return binary_error(out, CS_ERR, handle, id, "x has no value");
+        if (n == 0) ok = calc_run(&c->prog, c->prog.consts, 0, res, errmsg, sizeof(errmsg));
+        else if (n == 1) ok = calc_run(&c->prog, c->prog.consts, x[0], res, errmsg, sizeof(errmsg));
+        else ok = calc_run_batch(&c->prog, c->prog.consts, kern, x, n, res, errmsg, sizeof(errmsg));
+        nres = n > 0 ? n : 1;
+    } else if (op >= CW_ADD && op <= CW_POW) {
+        if (n != 2) return binary_error(out, CS_BAD_REQUEST, handle, id, "needs 2 operands");
+        switch (op) {
+        case CW_ADD: res[0] = x[0] + x[1]; break;
+        case CW_SUB: res[0] = x[0] - x[1]; break;
+        case CW_MUL: res[0] = x[0] * x[1]; break;
+        case CW_DIV:
+            if (x[1] == 0) return binary_error(out, CS_ERR, handle, id, "divide by zero");
+            res[0] = x[0] / x[1];
+            break;
+        default: res[0] = pow(x[0], x[1]); break;
         }
+    } else if (op >= CW_NEG && op <= CW_LN) {
+        if (n != 1) return binary_error(out, CS_BAD_REQUEST, handle, id, "needs 1 operand");
+        switch (op) {
+        case CW_NEG: res[0] = -x[0]; break;
+        case CW_SQRT:
+            if (x[0] < 0) return binary_error(out, CS_ERR, handle, id, "sqrt of negative");
+            res[0] = sqrt(x[0]);
+            break;
+        case CW_INV:
+            if (x[0] == 0) return binary_error(out, CS_ERR, handle, id, "divide by zero");
+            res[0] = 1.0 / x[0];
+            break;
+        case CW_SIN: res[0] = sin(x[0]); break;
+        case CW_COS: res[0] = cos(x[0]); break;
+        case CW_TAN: res[0] = tan(x[0]); break;
+        case CW_EXP: res[0] = exp(x[0]); break;
+        default: res[0] = log(x[0]); break;
+        }
+    } else {
+        return binary_error(out, CS_BAD_REQUEST, handle, id, "unknown op");
     }
+    if (!ok) return binary_error(out, CS_ERR, handle, id, errmsg);
 
-    // maybe single number
-    double v;
-    if (parse_double(s, &v)) { *res = v; return 1; }
-    snprintf(errmsg, emsglen, "unsupported expression");
-    return 0;
+    cw_header(out, CS_OK, nres, handle, id);
+    for (int i = 0; i < nres; i++) cw_put_f64(out + CW_HDR + 8 * i, res[i]);
+    return CW_HDR + 8 * nres;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) { printf("Usage: %s <port>\n", argv[0]); return 1; }
-    int port = atoi(argv[1]);
-
+int open_socket(int port, int reuseport) {
+    int opt = 1;
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) { perror("socket"); return 1; }
+    if (sock < 0) { perror("socket"); exit(1); }
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT"); exit(1);
+    }
 
-    struct sockaddr_in serv, cli;
+    struct sockaddr_in serv;
     memset(&serv, 0, sizeof(serv));
     serv.sin_family = AF_INET;
     serv.sin_addr.s_addr = INADDR_ANY;
     serv.sin_port = htons(port);
 
-    if (bind(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind"); return 1; }
+    if (bind(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind"); exit(1); }
+    return sock;
+}
+
+// Worker loop: everything it touches besides the kernel table and other
+// workers' cache counters (for STATS) is its own
+void *serve(void *arg) {
+    Worker *w = arg;
 
-    printf("UDP Calculator server listening on port %d\n", port);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);   // best effort
+
+    for (int i = 0; i < BATCH; i++) {
+        w->in_iov[i].iov_base = w->in_buf[i];
+        w->in_iov[i].iov_len = BUF - 1;
+        w->in[i].msg_hdr.msg_iov = &w->in_iov[i];
+        w->in[i].msg_hdr.msg_iovlen = 1;
+        w->in[i].msg_hdr.msg_name = &w->addrs[i];
+        w->out_iov[i].iov_base = w->out_buf[i];
+        w->out[i].msg_hdr.msg_iov = &w->out_iov[i];
+        w->out[i].msg_hdr.msg_iovlen = 1;
+        w->out[i].msg_hdr.msg_name = &w->addrs[i];
+    }
 
-    char buf[BUF];
-    socklen_t cli_len = sizeof(cli);
     while (1) {
-        ssize_t r = recvfrom(sock, buf, sizeof(buf)-1, 0, (struct sockaddr*)&cli, &cli_len);
-        if (r < 0) continue;
-        buf[r] = 0;
-
-        // Expect messages: ID|expression
-        char id[64], expr[512];
-        char *pipe = strchr(buf, '|');
-        if (!pipe) {
-            // malformed
-            char resp[BUF];
-            snprintf(resp, sizeof(resp), "0|ERR|malformed request");
-            sendto(sock, resp, strlen(resp), 0, (struct sockaddr*)&cli, cli_len);
-            continue;
+        for (int i = 0; i < BATCH; i++) w->in[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+
+        // Blocks for the first datagram, then takes whatever else is queued
+        int n = recvmmsg(w->sock, w->in, BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+
+        for (int i = 0; i < n; i++) {
+            char *buf = w->in_buf[i];
+            int len = w->in[i].msg_len;
+            buf[len] = 0;
+            w->out_iov[i].iov_len = (uint8_t)buf[0] == CW_MAGIC ? handle_binary(w, buf, len, w->out_buf[i])
+                                                                 : handle_request(w, buf, w->out_buf[i]);
+            w->out[i].msg_hdr.msg_namelen = w->in[i].msg_hdr.msg_namelen;
         }
-        int idlen = pipe - buf;
-        strncpy(id, buf, idlen); id[idlen]=0;
-        strncpy(expr, pipe+1, sizeof(expr)-1); expr[sizeof(expr)-1]=0;
-        char *e = trim(expr);
-
-        double result;
-        char errmsg[128];
-        if (eval_expr(e, &result, errmsg, sizeof(errmsg))) {
-            char out[BUF];
-            // send ID|OK|<result>
-            snprintf(out, sizeof(out), "%s|OK|%.8g", id, result);
-            sendto(sock, out, strlen(out), 0, (struct sockaddr*)&cli, cli_len);
-        } else {
-            char out[BUF];
-            snprintf(out, sizeof(out), "%s|ERR|%s", id, errmsg);
-            sendto(sock, out, strlen(out), 0, (struct sockaddr*)&cli, cli_len);
+        for (int sent = 0; sent < n; ) {
+            int r = sendmmsg(w->sock, w->out + sent, n - sent, 0);
+            if (r <= 0) break;
+            sent += r;
         }
     }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) { printf("Usage: %s <port> [cache_entries] [workers]\n", argv[0]); return 1; }
+    int port = atoi(argv[1]);
+    int entries = argc > 2 ? atoi(argv[2]) : DEFAULT_CACHE;
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    nworkers = argc > 3 ? atoi(argv[3]) : ncpu;
+    if (nworkers < 1) nworkers = 1;
+    kern = calc_kernels(-1);
+
+    workers = calloc(nworkers, sizeof(Worker *));
+    if (!workers) { printf("Out of memory\n"); return 1; }
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = calloc(1, sizeof(Worker));
+        if (!workers[i] || !(workers[i]->cache = calc_cache_new(entries))) { printf("Out of memory\n"); return 1; }
+        workers[i]->index = i;
+        workers[i]->sock = open_socket(port, nworkers > 1);
+        workers[i]->cpu = i % ncpu;
+        workers[i]->next_handle = (uint32_t)time(NULL) * 2654435761u + i;     // unlike a previous run's
+    }
 
-    close(sock);
+    printf("UDP Calculator server listening on port %d (%d workers, %s batch kernels)\n", port, nworkers, kern->name);
+    fflush(stdout);
+
+    for (int i = 1; i < nworkers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve, workers[i]) != 0) { perror("pthread_create"); return 1; }
+        pthread_detach(tid);
+    }
+    serve(workers[0]);
     return 0;
 }
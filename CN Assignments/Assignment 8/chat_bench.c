@@ -0,0 +1,436 @@
+// chat_bench.c
+// Fan-out benchmark for chat_server: for each room size N, connects N
+// clients over TCP, moves them into a fresh room, and has M of them send
+// at a fixed rate for a while. Every message carries the time it was due
+// to be sent, so each member that receives it records the end-to-end
+// latency, senders' own copies included. Sends follow the schedule
+// whether or not replies keep up (open loop), so a slow server shows up
+// as latency instead of a lower send rate.
+// Compile: gcc -O2 chat_bench.c -o chat_bench -pthread
+// Run: ./chat_bench [-s server_ip] [-p port] [-n sizes] [-m senders] [-r rate]
+//                   [-d seconds] [-t threads] [-o csv_file]
+//   -n - comma-separated room sizes (default 10,100,1000,10000)
+//   -m - clients that send (default 10, at most N)
+//   -r - messages per second from each sender (default 10)
+//   -d - seconds of sending per size (default 5)
+//   -t - client threads, each running an epoll loop over its share (default 4)
+//   -o - also write the results as CSV to csv_file ("-" for stdout)
+//
+// Per size it prints messages delivered per second, the fraction of the
+// N * sent deliveries that arrived (the server's slow-client policy may
+// drop some), and latency percentiles. A sender's socket is non-blocking
+// with its own output buffer; a message due while the server is OUT_CAP
+// bytes behind that sender is counted as not sent. Start the server with -q large
+// enough for the rate, and raise ulimit -n for 10k clients on both sides.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "chat_frame.h"
+#include "../common/latency_hist.h"
+
+#define MAX_SIZES 16
+#define JOIN_WAVE 256           // clients connected before waiting for their joins
+#define JOIN_TIMEOUT_SEC 30
+#define DRAIN_MS 1000           // after the last send, for deliveries to arrive
+#define MAX_EVENTS 256
+#define OUT_CAP 16384           // a sender's frames not yet taken by the socket
+
+typedef struct {
+    int fd;
+    int sender;
+    uint64_t next_send;         // when the next message is due
+    char id[32];                // ip:port, as the server names us
+    size_t idlen;
+    int joined;
+    char *out;                  // senders only: OUT_CAP bytes
+    size_t outlen, outoff;
+    int want_out;               // EPOLLOUT armed
+    size_t inlen;
+    char in[FRAME_HDR + FRAME_MAX];
+} Conn;
+
+typedef struct {
+    int epfd;
+    Conn **senders;
+    int nsenders;
+    LatencyHist hist;
+    uint64_t sent, delivered, closed, backlogged;
+    pthread_t tid;
+} Worker;
+
+char *server_ip = "127.0.0.1";
+int port = 9090;
+int nsenders = 10;
+double rate = 10;
+int seconds = 5;
+int nthreads = 4;
+
+char room[64];
+char join_tail[96];             // " joined #room."
+size_t join_tail_len;
+atomic_int joined;
+atomic_int running;             // workers keep going while set
+uint64_t t_start, t_end;        // the sending window
+atomic_int sending;
+
+/* One whole frame from the server */
+void on_text(Worker *w, Conn *c, const char *text, uint32_t len, uint64_t now) {
+    const char *sep = memmem(text, len, " : ", 3);
+    if (sep && text + len - sep > 5 && sep[3] == 'b' && sep[4] == ' ') {
+        uint64_t due = 0;
+        for (const char *p = sep + 5; p < text + len && *p >= '0' && *p <= '9'; p++)
+            due = due * 10 + (*p - '0');
+        if (due >= t_start && due < t_end) {
+            hist_record(&w->hist, now > due ? now - due : 0);
+            w->delivered++;
+        }
+        return;
+    }
+    if (!c->joined && len == c->idlen + join_tail_len && memcmp(text, c->id, c->idlen) == 0 &&
+        memcmp(text + c->idlen, join_tail, join_tail_len) == 0) {
+        c->joined = 1;
+        atomic_fetch_add(&joined, 1);
+    }
+}
+
+/* Read everything available. Returns -1 once the server has closed c. */
+int on_readable(Worker *w, Conn *c) {
+    while (1) {
+        ssize_t r = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r <= 0) return -1;
+        c->inlen += r;
+
+        uint64_t now = now_ns();
+        size_t pos = 0;
+        const char *text;
+        uint32_t tlen;
+        int k;
+        while ((k = frame_next(c->in + pos, c->inlen - pos, &text, &tlen)) > 0) {
+            on_text(w, c, text, tlen, now);
+            pos += k;
+        }
+        if (k < 0) return -1;
+        memmove(c->in, c->in + pos, c->inlen - pos);
+        c->inlen -= pos;
+    }
+}
+
+/* For the /join, while the socket is still blocking */
+int send_frame(int fd, const char *text, size_t len) {
+    char frame[FRAME_HDR + 128];
+    if (len > 128) return -1;
+    frame_put_len(frame, len);
+    memcpy(frame + FRAME_HDR, text, len);
+    return send(fd, frame, FRAME_HDR + len, MSG_NOSIGNAL) == (ssize_t)(FRAME_HDR + len) ? 0 : -1;
+}
+
+/* Append a frame to c's output; -1 if OUT_CAP is full */
+int queue_frame(Conn *c, const char *text, size_t len) {
+    if (c->outlen + FRAME_HDR + len > OUT_CAP) return -1;
+    frame_put_len(c->out + c->outlen, len);
+    memcpy(c->out + c->outlen + FRAME_HDR, text, len);
+    c->outlen += FRAME_HDR + len;
+    return 0;
+}
+
+/* Send what the socket takes and keep the rest, so a short write never
+   leaves half a frame behind. EPOLLOUT is armed while output is left.
+   Returns -1 once the connection is gone. */
+int flush_out(Worker *w, Conn *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t s = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (s < 0) return -1;
+        c->outoff += s;
+    }
+    if (c->outoff > 0) {
+        memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+        c->outlen -= c->outoff;
+        c->outoff = 0;
+    }
+    int want = c->outlen > 0;
+    if (want != c->want_out) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want;
+    }
+    return 0;
+}
+
+void conn_close(Worker *w, Conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    w->closed++;
+}
+
+/* Send whatever is due; returns ms until the next one (-1: nothing left) */
+int send_due(Worker *w) {
+    uint64_t now = now_ns(), next = UINT64_MAX;
+    for (int i = 0; i < w->nsenders; i++) {
+        Conn *c = w->senders[i];
+        int queued = 0;
+        while (c->fd >= 0 && c->next_send <= now && c->next_send < t_end) {
+            char text[48];
+            int n = snprintf(text, sizeof(text), "b %llu", (unsigned long long)c->next_send);
+            if (queue_frame(c, text, n) == 0) {
+                w->sent++;
+                queued = 1;
+            } else {
+                w->backlogged++;    // the server has not read this sender's last OUT_CAP bytes
+            }
+            c->next_send += (uint64_t)(1e9 / rate);
+        }
+        if (queued && flush_out(w, c) < 0) conn_close(w, c);
+        if (c->fd >= 0 && c->next_send < t_end && c->next_send < next) next = c->next_send;
+    }
+    if (next == UINT64_MAX) return -1;
+    return (int)((next - now) / 1000000);
+}
+
+void *worker_loop(void *arg) {
+    Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (atomic_load(&running)) {
+        int timeout = 20;
+        if (atomic_load(&sending)) {
+            int due = send_due(w);
+            if (due >= 0 && due < timeout) timeout = due;
+        }
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (c->fd >= 0 && (events[i].events & EPOLLOUT) && flush_out(w, c) < 0) conn_close(w, c);
+            if (c->fd >= 0 && on_readable(w, c) < 0) conn_close(w, c);
+        }
+    }
+    return NULL;
+}
+
+Conn *connect_client(int sender) {
+    Conn *c = calloc(1, sizeof(Conn));
+    if (!c) return NULL;
+    c->sender = sender;
+    if (sender && !(c->out = malloc(OUT_CAP))) {
+        free(c);
+        return NULL;
+    }
+    struct sockaddr_in serv, me;
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &serv.sin_addr);
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&serv, sizeof(serv)) < 0) {
+        perror("connect");
+        if (c->fd >= 0) close(c->fd);
+        free(c->out);
+        free(c);
+        return NULL;
+    }
+    socklen_t len = sizeof(me);
+    getsockname(c->fd, (struct sockaddr *)&me, &len);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &me.sin_addr, ip, sizeof(ip));
+    snprintf(c->id, sizeof(c->id), "%s:%d", ip, ntohs(me.sin_port));
+    c->idlen = strlen(c->id);
+
+    char cmd[80];
+    int n = snprintf(cmd, sizeof(cmd), "/join %s", room);
+    if (send_frame(c->fd, cmd, n) < 0) {
+        perror("send");
+        close(c->fd);
+        free(c->out);
+        free(c);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));    // each message on its own
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    return c;
+}
+
+int wait_joined(int want) {
+    for (int ms = 0; atomic_load(&joined) < want; ms += 10) {
+        if (ms > JOIN_TIMEOUT_SEC * 1000) return -1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+typedef struct {
+    int clients, senders;
+    uint64_t sent, delivered, closed, backlogged;
+    double per_sec, delivered_pct;
+    uint64_t p50, p90, p99, p999, max;
+} Result;
+
+int run_size(int nclients, Result *res) {
+    snprintf(room, sizeof(room), "bench%d_%d", (int)getpid(), nclients);
+    join_tail_len = snprintf(join_tail, sizeof(join_tail), " joined #%s.", room);
+    atomic_store(&joined, 0);
+    atomic_store(&sending, 0);
+    atomic_store(&running, 1);
+
+    int m = nsenders < nclients ? nsenders : nclients;
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    Conn **conns = calloc(nclients, sizeof(Conn *));
+    if (!workers || !conns) return -1;
+    for (int i = 0; i < nthreads; i++) {
+        Worker *w = &workers[i];
+        w->epfd = epoll_create1(0);
+        w->senders = calloc(m / nthreads + 1, sizeof(Conn *));
+        hist_init(&w->hist);
+        pthread_create(&w->tid, NULL, worker_loop, w);
+    }
+
+    int ok = 0, n = 0;
+    for (; n < nclients; n++) {
+        Conn *c = conns[n] = connect_client(n < m);
+        if (!c) break;
+        Worker *w = &workers[n % nthreads];
+        if (c->sender) w->senders[w->nsenders++] = c;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        if ((n + 1) % JOIN_WAVE == 0 && wait_joined(n + 1) < 0) break;
+    }
+    if (n < nclients || wait_joined(nclients) < 0) {
+        fprintf(stderr, "%d clients: only %d of them joined\n", nclients, atomic_load(&joined));
+        ok = -1;
+    }
+
+    if (ok == 0) {
+        usleep(200000);     // let join notices drain
+        uint64_t period = (uint64_t)(1e9 / rate);
+        t_start = now_ns() + 50000000;
+        t_end = t_start + (uint64_t)seconds * 1000000000u;
+        for (int i = 0; i < m; i++) conns[i]->next_send = t_start + period * i / m;
+        atomic_store(&sending, 1);
+        usleep(seconds * 1000000 + 50000 + DRAIN_MS * 1000);
+    }
+    atomic_store(&running, 0);
+
+    memset(res, 0, sizeof(*res));
+    LatencyHist all;
+    hist_init(&all);
+    for (int i = 0; i < nthreads; i++) {
+        Worker *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        hist_merge(&all, &w->hist);
+        res->sent += w->sent;
+        res->delivered += w->delivered;
+        res->closed += w->closed;
+        res->backlogged += w->backlogged;
+        close(w->epfd);
+        free(w->senders);
+    }
+    for (int i = 0; i < n; i++) {
+        if (conns[i] && conns[i]->fd >= 0) close(conns[i]->fd);
+        if (conns[i]) free(conns[i]->out);
+        free(conns[i]);
+    }
+    free(conns);
+    free(workers);
+
+    res->clients = nclients;
+    res->senders = m;
+    res->per_sec = (double)res->delivered / seconds;
+    res->delivered_pct = res->sent ? 100.0 * res->delivered / ((double)res->sent * nclients) : 0;
+    res->p50 = hist_quantile(&all, 0.5);
+    res->p90 = hist_quantile(&all, 0.9);
+    res->p99 = hist_quantile(&all, 0.99);
+    res->p999 = hist_quantile(&all, 0.999);
+    res->max = all.total ? all.max : 0;
+    sleep(1);   // let the server see the disconnects before the next size
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES] = { 10, 100, 1000, 10000 }, nsizes = 4;
+    const char *csv_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:n:m:r:d:t:o:")) != -1) {
+        if (opt == 's') server_ip = optarg;
+        else if (opt == 'p') port = atoi(optarg);
+        else if (opt == 'm') nsenders = atoi(optarg);
+        else if (opt == 'r') rate = atof(optarg);
+        else if (opt == 'd') seconds = atoi(optarg);
+        else if (opt == 't') nthreads = atoi(optarg);
+        else if (opt == 'o') csv_path = optarg;
+        else if (opt == 'n') {
+            nsizes = 0;
+            for (char *p = strtok(optarg, ","); p && nsizes < MAX_SIZES; p = strtok(NULL, ","))
+                if (atoi(p) > 0) sizes[nsizes++] = atoi(p);
+        } else {
+            fprintf(stderr, "Usage: %s [-s server_ip] [-p port] [-n sizes] [-m senders] [-r rate] "
+                            "[-d seconds] [-t threads] [-o csv_file]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nsenders < 1) nsenders = 1;
+    if (rate <= 0) rate = 1;
+    if (seconds < 1) seconds = 1;
+    if (nthreads < 1) nthreads = 1;
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    printf("%s:%d, %d senders x %.0f msg/s, %d s per size\n", server_ip, port, nsenders, rate, seconds);
+    printf("%8s %8s %10s %12s %12s %10s %10s %10s %10s %10s\n", "clients", "sent", "delivered",
+           "deliv/s", "delivered%", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    Result results[MAX_SIZES];
+    for (int i = 0; i < nsizes; i++) {
+        Result *r = &results[i];
+        if (run_size(sizes[i], r) < 0) {
+            nsizes = i;
+            break;
+        }
+        printf("%8d %8llu %10llu %12.0f %11.2f%% %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               r->clients, (unsigned long long)r->sent, (unsigned long long)r->delivered, r->per_sec,
+               r->delivered_pct, r->p50 / 1e3, r->p90 / 1e3, r->p99 / 1e3, r->p999 / 1e3, r->max / 1e3);
+        if (r->closed) printf("%8s %llu clients were disconnected by the server\n", "", (unsigned long long)r->closed);
+        if (r->backlogged)
+            printf("%8s %llu messages not sent: the server fell %d bytes behind a sender\n", "",
+                   (unsigned long long)r->backlogged, OUT_CAP);
+        fflush(stdout);
+    }
+
+    if (csv_path) {
+        FILE *f = strcmp(csv_path, "-") == 0 ? stdout : fopen(csv_path, "w");
+        if (!f) { perror("fopen csv"); return 1; }
+        fprintf(f, "clients,senders,rate_per_sender,seconds,sent,delivered,delivered_per_sec,"
+                   "delivered_pct,p50_us,p90_us,p99_us,p999_us,max_us,disconnected\n");
+        for (int i = 0; i < nsizes; i++) {
+            Result *r = &results[i];
+            fprintf(f, "%d,%d,%g,%d,%llu,%llu,%.0f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu\n",
+                    r->clients, r->senders, rate, seconds, (unsigned long long)r->sent,
+                    (unsigned long long)r->delivered, r->per_sec, r->delivered_pct,
+                    r->p50 / 1e3, r->p90 / 1e3, r->p99 / 1e3, r->p999 / 1e3, r->max / 1e3,
+                    (unsigned long long)r->closed);
+        }
+        if (f != stdout) fclose(f);
+    }
+    return 0;
+}
@@ -8,21 +8,38 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include "chat_frame.h"
 
 #define BUF 1024
 
 int sockfd;
 
+/* Print every whole message received; keep a partial one for the next recv */
 void *recv_thread(void *arg) {
-    char buf[BUF];
+    static char buf[FRAME_HDR + FRAME_MAX];
+    size_t len = 0;
     while (1) {
-        ssize_t r = recv(sockfd, buf, sizeof(buf)-1, 0);
+        ssize_t r = recv(sockfd, buf + len, sizeof(buf) - len, 0);
         if (r <= 0) {
             printf("Server disconnected or error.\n");
             exit(0);
         }
-        buf[r] = 0;
-        printf("%s\n", buf);
+        len += r;
+
+        size_t pos = 0;
+        const char *text;
+        uint32_t tlen;
+        int k;
+        while ((k = frame_next(buf + pos, len - pos, &text, &tlen)) > 0) {
+            printf("%.*s\n", (int)tlen, text);
+            pos += k;
+        }
+        if (k < 0) {
+            printf("Bad message from server.\n");
+            exit(1);
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
     }
     return NULL;
 }
@@ -51,11 +68,15 @@ int main(int argc, char *argv[]) {
     pthread_create(&tid, NULL, recv_thread, NULL);
     pthread_detach(tid);
 
-    char line[BUF];
+    char frame[FRAME_HDR + BUF];
+    char *line = frame + FRAME_HDR;
     while (1) {
-        if (!fgets(line, sizeof(line), stdin)) break;
-        // send line as-is
-        if (send(sockfd, line, strlen(line), 0) <= 0) {
+        if (!fgets(line, BUF, stdin)) break;
+        // send the line without its newline, behind its length
+        size_t n = strcspn(line, "\r\n");
+        if (n == 0) continue;
+        frame_put_len(frame, n);
+        if (send(sockfd, frame, FRAME_HDR + n, 0) <= 0) {
             printf("Send failed\n");
             break;
         }
@@ -0,0 +1,39 @@
+// chat_frame.h
+// Framing shared by chat_server and chat_client. Every message, in either
+// direction, is a 4-byte big-endian length followed by that many bytes of
+// text (no trailing newline). TCP is a byte stream, so one recv can hold
+// part of a message or several of them; readers keep the unfinished tail
+// and complete it with the next recv.
+
+#ifndef CHAT_FRAME_H
+#define CHAT_FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_HDR 4
+#define FRAME_MAX 4096          // longest text in any frame
+#define CHAT_MAX_TEXT 1024      // longest text a client may send; the server adds the sender's id
+
+static inline void frame_put_len(char *p, uint32_t len) {
+    len = htonl(len);
+    memcpy(p, &len, FRAME_HDR);
+}
+
+// Looks for a whole frame at the start of buf (len bytes). Returns the
+// bytes it takes up and sets *text / *tlen, 0 if more is needed, or -1 if
+// the length is over FRAME_MAX (the peer does not speak this protocol).
+static inline int frame_next(const char *buf, size_t len, const char **text, uint32_t *tlen) {
+    uint32_t n;
+    if (len < FRAME_HDR) return 0;
+    memcpy(&n, buf, FRAME_HDR);
+    n = ntohl(n);
+    if (n > FRAME_MAX) return -1;
+    if (len < FRAME_HDR + n) return 0;
+    *text = buf + FRAME_HDR;
+    *tlen = n;
+    return FRAME_HDR + n;
+}
+
+#endif
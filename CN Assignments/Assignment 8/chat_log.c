@@ -0,0 +1,150 @@
+// chat_log.c
+// Producers push onto an atomic stack and ring an eventfd when they find it
+// empty, the same handoff the event loops use for their mailboxes. The
+// writer reverses what it takes back into arrival order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "chat_log.h"
+
+typedef struct Entry {
+    struct Entry *next;
+    time_t t;
+    size_t len;
+    char data[];
+} Entry;
+
+#define STAMP_LEN 22    // "[YYYY-mm-dd HH:MM:SS] "
+
+static _Atomic(Entry *) pending;
+static int log_fd = -1, wake_fd = -1;
+static int sync_policy;
+static int sync_interval_ms;
+
+void chat_log(const char *entry, size_t len) {
+    Entry *e = malloc(sizeof(Entry) + len);
+    if (!e) return;
+    e->t = time(NULL);
+    e->len = len;
+    memcpy(e->data, entry, len);
+
+    Entry *old = atomic_load(&pending);
+    do {
+        e->next = old;
+    } while (!atomic_compare_exchange_weak(&pending, &old, e));
+    if (!old) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    char *buf = NULL;
+    size_t cap = 0;
+    time_t stamp_t = (time_t)-1;
+    char stamp[STAMP_LEN + 1];
+    int dirty = 0;              // written since the last fdatasync
+    long long last_sync = now_ms();
+
+    while (1) {
+        int timeout = -1;
+        if (dirty && sync_policy == CHAT_LOG_SYNC_INTERVAL) {
+            long long left = last_sync + sync_interval_ms - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        struct pollfd pfd = { wake_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("log poll");
+            return NULL;
+        }
+        uint64_t n;
+        if (read(wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+        Entry *e = atomic_exchange(&pending, NULL), *fifo = NULL;
+        while (e) {
+            Entry *next = e->next;
+            e->next = fifo;
+            fifo = e;
+            e = next;
+        }
+
+        size_t len = 0;
+        while (fifo) {
+            e = fifo;
+            fifo = e->next;
+            if (len + STAMP_LEN + e->len + 1 > cap) {
+                size_t ncap = cap ? cap : 65536;
+                while (ncap < len + STAMP_LEN + e->len + 1) ncap *= 2;
+                char *nbuf = realloc(buf, ncap);
+                if (!nbuf) { free(e); continue; }
+                buf = nbuf;
+                cap = ncap;
+            }
+            if (e->t != stamp_t) {
+                struct tm tm;
+                localtime_r(&e->t, &tm);
+                strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] ", &tm);
+                stamp_t = e->t;
+            }
+            memcpy(buf + len, stamp, STAMP_LEN);
+            memcpy(buf + len + STAMP_LEN, e->data, e->len);
+            len += STAMP_LEN + e->len;
+            buf[len++] = '\n';
+            free(e);
+        }
+
+        if (len > 0) {
+            if (write_all(log_fd, buf, len) < 0) perror("log write");
+            dirty = 1;
+        }
+        if (dirty && (sync_policy == CHAT_LOG_SYNC_BATCH ||
+                      (sync_policy == CHAT_LOG_SYNC_INTERVAL && now_ms() - last_sync >= sync_interval_ms))) {
+            if (fdatasync(log_fd) < 0) perror("log fdatasync");
+            dirty = 0;
+            last_sync = now_ms();
+        }
+    }
+    return NULL;
+}
+
+int chat_log_start(const char *path, int policy, int interval_ms) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) return -1;
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0) return -1;
+    sync_policy = policy;
+    sync_interval_ms = interval_ms > 0 ? interval_ms : 1000;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
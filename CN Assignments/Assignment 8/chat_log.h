@@ -0,0 +1,27 @@
+// chat_log.h
+// Conversation log (log.txt) written off the message path. chat_log() only
+// stamps the entry with the current second and pushes it onto a lock-free
+// stack; one writer thread takes everything that has piled up, formats it
+// as "[YYYY-mm-dd HH:MM:SS] entry" lines (strftime once per second, not per
+// line) and appends the lot with a single write to a file it keeps open.
+//
+// Entries accepted but not yet written are lost if the server dies. What
+// has been written reaches the disk according to the sync policy:
+//   CHAT_LOG_SYNC_NONE      whenever the kernel gets to it
+//   CHAT_LOG_SYNC_BATCH     fdatasync after every write
+//   CHAT_LOG_SYNC_INTERVAL  fdatasync at most every interval_ms
+
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stddef.h>
+
+enum { CHAT_LOG_SYNC_NONE, CHAT_LOG_SYNC_BATCH, CHAT_LOG_SYNC_INTERVAL };
+
+// Open path for appending and start the writer. Returns -1 on error.
+int chat_log_start(const char *path, int sync_policy, int interval_ms);
+
+// Queue one entry (no newline) for the log. Never blocks on the file.
+void chat_log(const char *entry, size_t len);
+
+#endif
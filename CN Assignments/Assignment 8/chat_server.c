@@ -1,162 +1,675 @@
-// Compile: gcc chat_server.c -o chat_server -pthread
-// Run: sudo ./chat_server <port>
+// Compile: gcc chat_server.c chat_log.c -o chat_server -pthread
+// Client: chat_client.c (messages are length-prefixed, see chat_frame.h)
+// Load test: chat_bench.c (fan-out latency and throughput by room size)
+// Run: sudo ./chat_server <port> [-l event_loops] [-q queue_kb] [-p drop|disconnect|coalesce] [-f none|batch|ms] [-n history]
 // Example: sudo ./chat_server 9090
+//
+// Clients talk in named rooms: everyone starts in #lobby, "/join <room>"
+// moves to another (created on first use) and "/leave" goes back.
+//
+// Clients are spread over a few event-loop threads (-l, default 4), each
+// with its own epoll set. A message is posted once to the mailbox (woken
+// through an eventfd) of every loop that has members in the room, and each
+// loop hands it to its own members, so no lock is held while sending and
+// a loop never waits for a socket. A room's lock is only taken to order
+// its messages and for members coming and going; rooms are found through
+// a registry split in ROOM_SHARDS shards, so rooms do not share a lock.
+//
+// What a client has not read yet waits in its outbound queue, at most
+// queue_kb (default 64) KB. When a message would overflow it, the
+// slow-consumer policy (-p) decides:
+//   drop       - that client misses the message (default)
+//   disconnect - the client is dropped
+//   coalesce   - messages still waiting are thrown away for a
+//                "N messages skipped" notice, so the client catches up
+//                with the newest ones
+//
+// log.txt is written by its own thread (chat_log.c); -f sets how often it
+// is synced to disk: never (none, default), after every write (batch), or
+// at most every ms milliseconds.
+//
+// Each room remembers its last -n (default 20) messages; a client that
+// joins gets them in one write.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
-#include <time.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <errno.h>
+#include "chat_log.h"
+#include "chat_frame.h"
 
-#define MAX_CLIENTS 100
 #define BUF 1024
 #define LOGFILE "log.txt"
+#define DEFAULT_LOOPS 4
+#define DEFAULT_QUEUE_KB 64
+#define MAX_EVENTS 256
+#define MAX_IOV 128         // queued messages per writev
+#define DEFAULT_HISTORY 20
+#define ROOM_NAME 32
+#define ROOM_SHARDS 64
+#define ROOM_BUCKETS 64     // per shard
 
+enum { POLICY_DROP, POLICY_DISCONNECT, POLICY_COALESCE };
+
+/* A message as it goes on the wire, frame header included. Immutable once
+   built, and shared by every queue and history it sits in; the last
+   reference frees it. */
+typedef struct {
+    atomic_uint refs;
+    unsigned long seq;      // in its room
+    size_t len;             // FRAME_HDR + text
+    char data[];
+} Msg;
+
+/* One entry of a client's outbound queue */
 typedef struct {
-    int sock;
+    Msg *msg;
+    unsigned long skipped;  // coalesce notice: messages it stands for, else 0
+} QItem;
+
+typedef struct Room Room;
+
+typedef struct client_t {
+    int sock;                       // -1 once closed
     struct sockaddr_in addr;
+    char id[32];                    // ip:port
+    Room *room;
+    struct client_t *prev, *next;   // the room's members on this loop
+    unsigned long since;            // room messages up to here came with the join
+    QItem *q;                       // ring of qcap (a power of two) entries
+    unsigned qcap, qfirst, qcount;
+    size_t off;                     // bytes of the first entry already sent
+    size_t queued;                  // bytes in the queue not yet sent
+    unsigned long dropped;
+    int want_out;                   // EPOLLOUT armed
+    int dirty;                      // on the loop's list to flush
+    struct client_t *dirty_next;
+    size_t inlen;
+    char in[FRAME_HDR + FRAME_MAX]; // received, not yet a whole frame
 } client_t;
 
-client_t *clients[MAX_CLIENTS];
-int client_count = 0;
-pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t logfile_lock = PTHREAD_MUTEX_INITIALIZER;
-
-/* Add client to list */
-void add_client(client_t *c) {
-    pthread_mutex_lock(&clients_lock);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i] == NULL) {
-            clients[i] = c;
-            client_count++;
-            break;
+/* A chat room. Everything but local[] is guarded by lock, which only
+   broadcasts to this room and members coming or going take. Rooms live
+   until the server exits. */
+struct Room {
+    char name[ROOM_NAME];
+    unsigned hash;
+    Room *chain;                    // next room in the same registry bucket
+    pthread_mutex_t lock;
+    unsigned long seq;              // of the last message sent to the room
+    unsigned *members;              // per loop: how many of its clients are here
+    client_t **local;               // per loop: those clients, touched only by that loop
+    Msg **history;                  // ring of the last history_len messages
+    unsigned hist_first, hist_count;
+};
+
+/* The room registry, split in shards with a lock each so that looking up
+   one room never waits for a lookup of another in a different shard */
+typedef struct {
+    pthread_mutex_t lock;
+    Room *buckets[ROOM_BUCKETS];
+} RoomShard;
+
+/* Mailbox item: a new connection for the loop, or a message for its clients */
+typedef struct Mail {
+    struct Mail *next;
+    int sock;                       // >= 0: new connection
+    struct sockaddr_in addr;
+    Room *room;
+    Msg *msg;                       // holds one reference for the loop
+} Mail;
+
+typedef struct {
+    int index;
+    int epfd, evfd;
+    _Atomic(Mail *) mailbox;        // pushed by any thread, drained by the loop
+    client_t *dirty;                // clients with output queued by this drain
+    client_t *closed;               // freed after the current batch of events
+    pthread_t tid;
+} Loop;
+
+Loop *loops;
+int nloops = DEFAULT_LOOPS;
+size_t queue_limit = DEFAULT_QUEUE_KB * 1024;
+int policy = POLICY_DROP;
+unsigned history_len = DEFAULT_HISTORY;
+int log_sync = CHAT_LOG_SYNC_NONE;
+int log_sync_ms;
+RoomShard shards[ROOM_SHARDS];
+Room *lobby;
+
+/* Utility: get client id string IP:port */
+void client_id_str(client_t *c, char *buf, size_t n) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(c->addr.sin_addr), ip, sizeof(ip));
+    int port = ntohs(c->addr.sin_port);
+    snprintf(buf, n, "%s:%d", ip, port);
+}
+
+/* Room for a frame of tlen bytes of text, one reference */
+Msg *msg_new(size_t tlen) {
+    Msg *m = malloc(sizeof(Msg) + FRAME_HDR + tlen);
+    if (!m) return NULL;
+    atomic_init(&m->refs, 1);
+    m->len = FRAME_HDR + tlen;
+    frame_put_len(m->data, tlen);
+    return m;
+}
+
+static inline char *msg_text(Msg *m) { return m->data + FRAME_HDR; }
+
+Msg *msg_printf(const char *fmt, ...) {
+    char text[BUF];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n < 0) return NULL;
+    if (n >= (int)sizeof(text)) n = sizeof(text) - 1;
+    Msg *m = msg_new(n);
+    if (m) memcpy(msg_text(m), text, n);
+    return m;
+}
+
+void msg_unref(Msg *m, unsigned n) {
+    if (n && atomic_fetch_sub_explicit(&m->refs, n, memory_order_acq_rel) == n) free(m);
+}
+
+/* Push m onto l's mailbox; only the push that finds it empty needs a wakeup */
+void mail_post(Loop *l, Mail *m) {
+    Mail *old = atomic_load(&l->mailbox);
+    do {
+        m->next = old;
+    } while (!atomic_compare_exchange_weak(&l->mailbox, &old, m));
+    if (!old) {
+        uint64_t one = 1;
+        if (write(l->evfd, &one, sizeof(one)) < 0) perror("eventfd write");
+    }
+}
+
+/* Find the room called name, creating it on first use */
+Room *room_get(const char *name) {
+    unsigned h = 2166136261u;   // FNV-1a
+    for (const char *p = name; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    RoomShard *sh = &shards[h % ROOM_SHARDS];
+    Room **bucket = &sh->buckets[h / ROOM_SHARDS % ROOM_BUCKETS];
+
+    pthread_mutex_lock(&sh->lock);
+    Room *r = *bucket;
+    while (r && (r->hash != h || strcmp(r->name, name) != 0)) r = r->chain;
+    if (!r && (r = calloc(1, sizeof(Room)))) {
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->hash = h;
+        pthread_mutex_init(&r->lock, NULL);
+        r->members = calloc(nloops, sizeof(unsigned));
+        r->local = calloc(nloops, sizeof(client_t *));
+        r->history = calloc(history_len ? history_len : 1, sizeof(Msg *));
+        if (!r->members || !r->local || !r->history) {
+            free(r->members);
+            free(r->local);
+            free(r->history);
+            free(r);
+            r = NULL;
+        } else {
+            r->chain = *bucket;
+            *bucket = r;
         }
     }
-    pthread_mutex_unlock(&clients_lock);
+    pthread_mutex_unlock(&sh->lock);
+    return r;
 }
 
-/* Remove client from list */
-void remove_client(client_t *c) {
-    pthread_mutex_lock(&clients_lock);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i] == c) {
-            clients[i] = NULL;
-            client_count--;
-            break;
+/* Send msg to everyone in r, through the mailboxes of the loops that have
+   members there; nothing is copied. Takes over the caller's reference. */
+void room_broadcast(Room *r, Msg *msg) {
+    char entry[ROOM_NAME + FRAME_MAX + 4];
+    int n = snprintf(entry, sizeof(entry), "#%s %.*s", r->name, (int)(msg->len - FRAME_HDR), msg_text(msg));
+    chat_log(entry, n < (int)sizeof(entry) ? (size_t)n : sizeof(entry) - 1);
+
+    // Under the lock, so every loop gets the room's messages in seq order
+    pthread_mutex_lock(&r->lock);
+    msg->seq = ++r->seq;
+    unsigned refs = history_len ? 1 : 0;
+    for (int i = 0; i < nloops; i++) refs += r->members[i] > 0;
+    atomic_store_explicit(&msg->refs, refs, memory_order_relaxed);
+    if (history_len) {
+        if (r->hist_count == history_len) {
+            msg_unref(r->history[r->hist_first], 1);
+            r->hist_first = (r->hist_first + 1) % history_len;
+            r->hist_count--;
         }
+        r->history[(r->hist_first + r->hist_count++) % history_len] = msg;
+    }
+    for (int i = 0; i < nloops; i++) {
+        if (!r->members[i]) continue;
+        Mail *m = malloc(sizeof(Mail));
+        if (!m) { msg_unref(msg, 1); continue; }
+        m->sock = -1;
+        m->room = r;
+        m->msg = msg;
+        mail_post(&loops[i], m);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (!refs) free(msg);
+}
+
+/* Append to c's queue. The caller has already counted the reference. */
+int queue_push(client_t *c, Msg *m, unsigned long skipped) {
+    if (c->qcount == c->qcap) {
+        unsigned cap = c->qcap ? 2 * c->qcap : 16;
+        QItem *q = malloc(cap * sizeof(QItem));
+        if (!q) return -1;
+        for (unsigned i = 0; i < c->qcount; i++) q[i] = c->q[(c->qfirst + i) & (c->qcap - 1)];
+        free(c->q);
+        c->q = q;
+        c->qcap = cap;
+        c->qfirst = 0;
     }
-    pthread_mutex_unlock(&clients_lock);
+    QItem *it = &c->q[(c->qfirst + c->qcount++) & (c->qcap - 1)];
+    it->msg = m;
+    it->skipped = skipped;
+    c->queued += m->len;
+    return 0;
+}
+
+void queue_pop(client_t *c) {
+    msg_unref(c->q[c->qfirst].msg, 1);
+    c->qfirst = (c->qfirst + 1) & (c->qcap - 1);
+    c->qcount--;
+    c->off = 0;
 }
 
-/* Broadcast message to all clients */
-void broadcast_message(const char *msg, size_t len) {
-    pthread_mutex_lock(&clients_lock);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i]) {
-            ssize_t s = send(clients[i]->sock, msg, len, 0);
-            if (s <= 0) {
-                // ignore send errors here; client handler will catch disconnect
+/* Coalesce policy: replace every message not yet started by one notice */
+void queue_coalesce(client_t *c) {
+    unsigned keep = c->qcount && c->off > 0;   // the first one is partly on the wire
+    unsigned long skipped = 0, messages = 0;
+    while (c->qcount > keep) {
+        QItem *it = &c->q[(c->qfirst + c->qcount - 1) & (c->qcap - 1)];
+        skipped += it->skipped ? it->skipped : 1;   // an earlier notice carries its count over
+        messages += it->skipped ? 0 : 1;
+        c->queued -= it->msg->len;
+        msg_unref(it->msg, 1);
+        c->qcount--;
+    }
+    c->dropped += messages;
+
+    Msg *notice = msg_printf("*** %lu messages skipped (slow connection) ***", skipped);
+    if (notice && queue_push(c, notice, skipped) < 0) msg_unref(notice, 1);
+}
+
+void client_want_out(Loop *l, client_t *c, int want) {
+    if (want == c->want_out) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+    c->want_out = want;
+}
+
+/* Send queued output until the socket is full, up to MAX_IOV messages per
+   writev. Returns -1 if the client is gone. */
+int client_flush(Loop *l, client_t *c) {
+    while (c->qcount) {
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+        for (unsigned i = 0; i < c->qcount && n < MAX_IOV; i++, n++) {
+            Msg *m = c->q[(c->qfirst + i) & (c->qcap - 1)].msg;
+            iov[n].iov_base = m->data;
+            iov[n].iov_len = m->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + c->off;
+        iov[0].iov_len -= c->off;
+
+        ssize_t s = writev(c->sock, iov, n);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->queued -= s;
+        while (s > 0) {
+            size_t left = c->q[c->qfirst].msg->len - c->off;
+            if ((size_t)s < left) {
+                c->off += s;
+                break;
             }
+            s -= left;
+            queue_pop(c);
         }
+        if (c->qcount && c->off > 0) break;     // short write: the socket is full
     }
-    pthread_mutex_unlock(&clients_lock);
+    client_want_out(l, c, c->qcount > 0);
+    return 0;
 }
 
-/* Write log to file with timestamp */
-void write_log(const char *entry) {
-    pthread_mutex_lock(&logfile_lock);
-    FILE *f = fopen(LOGFILE, "a");
-    if (f) {
-        time_t t = time(NULL);
-        struct tm *tm = localtime(&t);
-        char timestr[64];
-        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", tm);
-        fprintf(f, "[%s] %s\n", timestr, entry);
-        fclose(f);
-    } else {
-        perror("fopen log");
+/* Have c flushed at the end of the current batch of events */
+void client_mark_dirty(Loop *l, client_t *c) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    c->dirty_next = l->dirty;
+    l->dirty = c;
+}
+
+/* Queue msg for c under the slow-consumer policy; it goes out with the
+   flush_dirty(). Returns 1 if c kept a reference, 0 if it missed the message,
+   -1 to disconnect c. */
+int client_send(Loop *l, client_t *c, Msg *msg) {
+    if (c->qcount && c->queued + msg->len > queue_limit && !c->want_out) {
+        // not stuck, just a long batch: make room first
+        if (client_flush(l, c) < 0) return -1;
     }
-    pthread_mutex_unlock(&logfile_lock);
+    if (c->qcount && c->queued + msg->len > queue_limit) {
+        if (policy == POLICY_DISCONNECT) {
+            printf("Client %s disconnected: too slow (%zu bytes queued)\n", c->id, c->queued);
+            return -1;
+        }
+        if (policy == POLICY_DROP) {
+            c->dropped++;
+            return 0;
+        }
+        queue_coalesce(c);
+    }
+    if (queue_push(c, msg, 0) < 0) return -1;
+    client_mark_dirty(l, c);
+    return 1;
 }
 
-/* Utility: get client id string IP:port */
-void client_id_str(client_t *c, char *buf, size_t n) {
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(c->addr.sin_addr), ip, sizeof(ip));
-    int port = ntohs(c->addr.sin_port);
-    snprintf(buf, n, "%s:%d", ip, port);
+/* Put c in room r (it is in none), queueing the room's history behind
+   whatever c has queued already. Every message sent to r after that
+   history reaches c through its loop; the ones before, which the loop may
+   still have in its mailbox, are skipped by seq. */
+void room_enter(Loop *l, client_t *c, Room *r) {
+    pthread_mutex_lock(&r->lock);
+    r->members[l->index]++;
+    c->prev = NULL;
+    c->next = r->local[l->index];
+    if (c->next) c->next->prev = c;
+    r->local[l->index] = c;
+    c->room = r;
+    c->since = r->seq;
+    for (unsigned i = 0; i < r->hist_count; i++) {
+        Msg *m = r->history[(r->hist_first + i) % history_len];
+        atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+        if (queue_push(c, m, 0) < 0) msg_unref(m, 1);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    Msg *joinmsg = msg_printf("%s joined #%s.", c->id, r->name);
+    if (joinmsg) room_broadcast(r, joinmsg);
 }
 
-/* Thread function handling a client */
-void *client_handler(void *arg) {
-    client_t *c = (client_t *)arg;
-    char clientid[64];
-    client_id_str(c, clientid, sizeof(clientid));
+void room_leave(Loop *l, client_t *c) {
+    Room *r = c->room;
+    if (!r) return;
+    pthread_mutex_lock(&r->lock);
+    r->members[l->index]--;
+    if (c->prev) c->prev->next = c->next; else r->local[l->index] = c->next;
+    if (c->next) c->next->prev = c->prev;
+    pthread_mutex_unlock(&r->lock);
+    c->room = NULL;
 
-    // Send welcome message
-    char welcome[BUF];
-    snprintf(welcome, sizeof(welcome), "Welcome to GroupChat! You are %s\n", clientid);
-    send(c->sock, welcome, strlen(welcome), 0);
+    Msg *leave = msg_printf("%s left #%s.", c->id, r->name);
+    if (leave) room_broadcast(r, leave);
+}
 
-    // Announce join
-    char joinmsg[BUF];
-    snprintf(joinmsg, sizeof(joinmsg), "%s joined the chat.", clientid);
-    write_log(joinmsg);
-    broadcast_message(joinmsg, strlen(joinmsg));
+void client_close(Loop *l, client_t *c) {
+    if (c->dropped) printf("Client %s missed %lu messages\n", c->id, c->dropped);
+    close(c->sock);     // also leaves the epoll set
+    c->sock = -1;
+    room_leave(l, c);
+    while (c->qcount) queue_pop(c);
+    free(c->q);
 
-    char buffer[BUF];
-    while (1) {
-        ssize_t r = recv(c->sock, buffer, sizeof(buffer)-1, 0);
-        if (r <= 0) {
-            // disconnect or error
-            if (r == 0) {
-                // graceful close
-                printf("Client %s disconnected.\n", clientid);
-            } else {
-                printf("recv error from %s: %s\n", clientid, strerror(errno));
-            }
-            break;
+    // The batch being handled may still hold an event for c
+    c->next = l->closed;
+    l->closed = c;
+}
+
+void client_open(Loop *l, int sock, struct sockaddr_in *addr) {
+    client_t *c = calloc(1, sizeof(client_t));
+    if (!c) { close(sock); return; }
+    c->sock = sock;
+    c->addr = *addr;
+    client_id_str(c, c->id, sizeof(c->id));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        perror("epoll_ctl");
+        close(sock);
+        free(c);
+        return;
+    }
+
+    // Send welcome message, then the lobby's history, in one writev
+    Msg *welcome = msg_printf("Welcome to GroupChat! You are %s, in #%s. "
+                              "/join <room> to move, /leave to come back.", c->id, lobby->name);
+    if (!welcome || queue_push(c, welcome, 0) < 0) {
+        if (welcome) msg_unref(welcome, 1);
+        client_close(l, c);
+        return;
+    }
+    room_enter(l, c, lobby);
+    if (client_flush(l, c) < 0) client_close(l, c);
+}
+
+/* Reply to c alone */
+int client_notice(Loop *l, client_t *c, const char *text) {
+    Msg *m = msg_printf("%s", text);
+    if (!m) return 0;
+    int r = client_send(l, c, m);
+    if (r <= 0) msg_unref(m, 1);
+    return r < 0 ? -1 : 0;
+}
+
+/* "/join room" or "/leave" (back to the lobby). Returns -1 to disconnect c. */
+int client_command(Loop *l, client_t *c, const char *text, uint32_t tlen) {
+    char name[ROOM_NAME];
+    Room *to = NULL;
+    if (tlen > 6 && memcmp(text, "/join ", 6) == 0) {
+        uint32_t n = tlen - 6;
+        if (n >= ROOM_NAME || memchr(text + 6, ' ', n))
+            return client_notice(l, c, "*** room names are one word of at most 31 characters ***");
+        memcpy(name, text + 6, n);
+        name[n] = 0;
+        to = room_get(name);
+    } else if (tlen == 6 && memcmp(text, "/leave", 6) == 0) {
+        to = lobby;
+    } else {
+        return client_notice(l, c, "*** commands: /join <room>, /leave ***");
+    }
+    if (!to) return client_notice(l, c, "*** out of memory ***");
+    if (to == c->room) return 0;
+    room_leave(l, c);
+    room_enter(l, c, to);
+    client_mark_dirty(l, c);    // the history went straight into the queue
+    return 0;
+}
+
+/* Broadcast every whole frame received so far. Returns -1 when the
+   client is gone or breaks the framing. */
+int client_on_readable(Loop *l, client_t *c) {
+    ssize_t r = recv(c->sock, c->in + c->inlen, sizeof(c->in) - c->inlen, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (r <= 0) {
+        // disconnect or error
+        if (r == 0) printf("Client %s disconnected.\n", c->id);
+        else printf("recv error from %s: %s\n", c->id, strerror(errno));
+        return -1;
+    }
+    c->inlen += r;
+
+    size_t pos = 0, idlen = strlen(c->id);
+    const char *text;
+    uint32_t tlen;
+    int k;
+    while ((k = frame_next(c->in + pos, c->inlen - pos, &text, &tlen)) > 0 && tlen <= CHAT_MAX_TEXT) {
+        pos += k;
+        if (tlen > 0 && text[0] == '/') {
+            if (client_command(l, c, text, tlen) < 0) return -1;
+            continue;
         }
-        buffer[r] = 0;
-        // trim newlines
-        char *p = buffer;
-        while (*p && (*p == '\r' || *p == '\n')) p++;
         // form message: <clientid> : message
-        char msg[BUF*2];
-        snprintf(msg, sizeof(msg), "%s : %s", clientid, buffer);
-        // Log and broadcast
-        write_log(msg);
-        broadcast_message(msg, strlen(msg));
+        Msg *msg = msg_new(idlen + 3 + tlen);
+        if (!msg) continue;
+        memcpy(msg_text(msg), c->id, idlen);
+        memcpy(msg_text(msg) + idlen, " : ", 3);
+        memcpy(msg_text(msg) + idlen + 3, text, tlen);
+        // Log and broadcast to the sender's room
+        room_broadcast(c->room, msg);
+    }
+    if (k != 0) {
+        printf("Client %s sent a bad frame\n", c->id);
+        return -1;
+    }
+    memmove(c->in, c->in + pos, c->inlen - pos);
+    c->inlen -= pos;
+    return 0;
+}
+
+/* Queue a message for this loop's members of room r. Their references are
+   taken with one atomic add up front, and the unused ones (plus the
+   mailbox's) given back with one subtract, however many members there are. */
+void deliver(Loop *l, Room *r, Msg *msg) {
+    unsigned n = r->members[l->index], kept = 0;  // only this loop changes its count
+    atomic_fetch_add_explicit(&msg->refs, n, memory_order_relaxed);
+    for (client_t *c = r->local[l->index], *next; c; c = next) {
+        next = c->next;
+        if (msg->seq <= c->since) continue;     // came with the history
+        int res = client_send(l, c, msg);
+        if (res < 0) client_close(l, c);
+        else kept += res;
     }
+    msg_unref(msg, n - kept + 1);
+}
 
-    // announce leave
-    char leave[BUF];
-    snprintf(leave, sizeof(leave), "%s left the chat.", clientid);
-    write_log(leave);
-    broadcast_message(leave, strlen(leave));
+/* Take everything posted to the loop, oldest first */
+void drain_mailbox(Loop *l) {
+    uint64_t n;
+    if (read(l->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+    Mail *m = atomic_exchange(&l->mailbox, NULL), *fifo = NULL;
+    while (m) {     // the mailbox is a stack: reverse it
+        Mail *next = m->next;
+        m->next = fifo;
+        fifo = m;
+        m = next;
+    }
+    while (fifo) {
+        m = fifo;
+        fifo = m->next;
+        if (m->sock >= 0) client_open(l, m->sock, &m->addr);
+        else deliver(l, m->room, m->msg);
+        free(m);
+    }
+}
 
-    // cleanup
-    close(c->sock);
-    remove_client(c);
-    free(c);
-    pthread_exit(NULL);
+/* Write what the batch queued, one writev per client */
+void flush_dirty(Loop *l) {
+    while (l->dirty) {
+        client_t *c = l->dirty;
+        l->dirty = c->dirty_next;
+        c->dirty = 0;
+        if (c->sock >= 0 && c->qcount && !c->want_out && client_flush(l, c) < 0) client_close(l, c);
+    }
+}
+
+void *event_loop(void *arg) {
+    Loop *l = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(l->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            client_t *c = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            if (!c) { drain_mailbox(l); continue; }
+            if (c->sock < 0) continue;  // closed earlier in this batch
+
+            int dead = 0;
+            if (ev & EPOLLIN) dead = client_on_readable(l, c) < 0;
+            else if (ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) dead = 1;
+            if (!dead && (ev & EPOLLOUT)) dead = client_flush(l, c) < 0;
+            if (dead) client_close(l, c);
+        }
+        flush_dirty(l);
+        while (l->closed) {
+            client_t *c = l->closed;
+            l->closed = c->next;
+            free(c);
+        }
+    }
+    return NULL;
 }
 
 /* Main server */
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]); return 1;
+        fprintf(stderr, "Usage: %s <port> [-l event_loops] [-q queue_kb] [-p drop|disconnect|coalesce] [-f none|batch|ms] [-n history]\n", argv[0]);
+        return 1;
     }
     int port = atoi(argv[1]);
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "l:q:p:f:n:")) != -1) {
+        if (opt == 'l') nloops = atoi(optarg);
+        else if (opt == 'q') queue_limit = (size_t)atoi(optarg) * 1024;
+        else if (opt == 'p' && strcmp(optarg, "drop") == 0) policy = POLICY_DROP;
+        else if (opt == 'p' && strcmp(optarg, "disconnect") == 0) policy = POLICY_DISCONNECT;
+        else if (opt == 'p' && strcmp(optarg, "coalesce") == 0) policy = POLICY_COALESCE;
+        else if (opt == 'f' && strcmp(optarg, "none") == 0) log_sync = CHAT_LOG_SYNC_NONE;
+        else if (opt == 'f' && strcmp(optarg, "batch") == 0) log_sync = CHAT_LOG_SYNC_BATCH;
+        else if (opt == 'n' && atoi(optarg) >= 0) history_len = atoi(optarg);
+        else if (opt == 'f' && atoi(optarg) > 0) {
+            log_sync = CHAT_LOG_SYNC_INTERVAL;
+            log_sync_ms = atoi(optarg);
+        }
+        else {
+            fprintf(stderr, "Usage: %s <port> [-l event_loops] [-q queue_kb] [-p drop|disconnect|coalesce] [-f none|batch|ms] [-n history]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nloops < 1) nloops = 1;
+    if (queue_limit < BUF) queue_limit = BUF;
+    if (history_len > MAX_IOV - 1) history_len = MAX_IOV - 1;  // replay stays one writev
+
+    // One descriptor per client: allow as many as the hard limit does
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // writev() has no MSG_NOSIGNAL: a peer that is gone must cost only its
+    // own connection (EPIPE), not the process
+    signal(SIGPIPE, SIG_IGN);
 
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) { perror("socket"); return 1; }
 
-    int opt = 1;
+    opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     struct sockaddr_in serv, cli;
@@ -169,37 +682,61 @@ int main(int argc, char *argv[]) {
         perror("bind"); return 1;
     }
 
-    if (listen(server_fd, 10) < 0) { perror("listen"); return 1; }
+    if (listen(server_fd, SOMAXCONN) < 0) { perror("listen"); return 1; }
 
-    printf("Chat server listening on port %d\n", port);
+    if (chat_log_start(LOGFILE, log_sync, log_sync_ms) < 0) { perror("log"); return 1; }
+
+    loops = calloc(nloops, sizeof(Loop));
+    if (!loops) { perror("calloc"); return 1; }
+    for (int i = 0; i < ROOM_SHARDS; i++) pthread_mutex_init(&shards[i].lock, NULL);
+    lobby = room_get("lobby");
+    if (!lobby) { perror("calloc"); return 1; }
+    for (int i = 0; i < nloops; i++) {
+        loops[i].epfd = epoll_create1(0);
+        loops[i].evfd = eventfd(0, EFD_NONBLOCK);
+        loops[i].index = i;
+        if (loops[i].epfd < 0 || loops[i].evfd < 0) { perror("epoll/eventfd"); return 1; }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;     // the mailbox
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].evfd, &ev);
+        if (pthread_create(&loops[i].tid, NULL, event_loop, &loops[i]) != 0) {
+            perror("pthread_create"); return 1;
+        }
+    }
+
+    const char *names[] = { "drop", "disconnect", "coalesce" };
+    printf("Chat server listening on port %d (%d event loops, %zu KB queues, %s slow clients)\n",
+           port, nloops, queue_limit / 1024, names[policy]);
 
     // Remove old log file or keep it? We'll append. Uncomment to reset:
     // remove(LOGFILE);
 
+    // Accept here and hand connections round-robin to the loops
+    int next = 0;
     while (1) {
         socklen_t c = sizeof(cli);
         int newfd = accept(server_fd, (struct sockaddr *)&cli, &c);
         if (newfd < 0) {
             perror("accept"); continue;
         }
-        client_t *cl = malloc(sizeof(client_t));
-        cl->sock = newfd;
-        cl->addr = cli;
-        add_client(cl);
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_handler, (void*)cl) != 0) {
-            perror("pthread_create");
-            // cleanup
-            remove_client(cl);
-            close(newfd);
-            free(cl);
-        } else {
-            pthread_detach(tid);
-            char cid[64];
-            client_id_str(cl, cid, sizeof(cid));
-            printf("Accepted connection from %s\n", cid);
-        }
+        fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL, 0) | O_NONBLOCK);
+        // Output is already batched into one writev per client; Nagle would
+        // only hold back the next batch until the last one is acked
+        int one = 1;
+        setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Mail *m = malloc(sizeof(Mail));
+        if (!m) { close(newfd); continue; }
+        m->sock = newfd;
+        m->addr = cli;
+        m->msg = NULL;
+        mail_post(&loops[next], m);
+        next = (next + 1) % nloops;
+
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &cli.sin_addr, ip, sizeof(ip));
+        printf("Accepted connection from %s:%d\n", ip, ntohs(cli.sin_port));
     }
 
     close(server_fd);
@@ -1,7 +1,15 @@
 // file_server.c
-// Compile: gcc file_server.c -o file_server
-// Run: ./file_server <port> <server_directory>
+// Compile: gcc file_server.c -o file_server -pthread
+// Run: ./file_server <port> <server_directory> [-c]
 // Example: ./file_server 9090 /home/mininet/server_dir
+//
+// Every connection gets its own thread, so a large transfer no longer holds
+// up other clients. File data does not pass through user space: downloads
+// go out with sendfile() straight from the page cache, and uploads are
+// spliced from the socket into a pipe and from the pipe into the file.
+// -c uses the old 8 KB read()/send() and recv()/write() loops instead, to
+// compare; a file system that cannot sendfile or splice falls back to
+// them on its own.
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -9,14 +17,28 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <errno.h>
 
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN
 #define BUF 8192
+#define HDR_MAX 512
+#define SENDFILE_CHUNK (1 << 30)    // a sendfile() call moves at most ~2 GB anyway
+#define PIPE_SIZE (1 << 20)         // splice chunk; the default pipe holds 64 KB
+
+typedef struct {
+    int fd;
+    struct sockaddr_in cli;
+} Conn;
+
+const char *server_dir;
+int copy_mode;      // -c
 
 // time diff in seconds (double)
 double timediff_sec(struct timespec a, struct timespec b) {
@@ -45,17 +67,239 @@ ssize_t full_send(int fd, const void *buf, size_t len) {
     return sent;
 }
 
+ssize_t full_write(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    const char *p = buf;
+    while (done < len) {
+        ssize_t w = write(fd, p + done, len - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        done += w;
+    }
+    return done;
+}
+
+/* Old path: through an 8 KB buffer. Returns the bytes sent. */
+long long send_file_copy(int fd, int infd) {
+    char buf[BUF];
+    ssize_t rr;
+    long long sent = 0;
+    while ((rr = read(infd, buf, sizeof(buf))) > 0) {
+        if (full_send(fd, buf, rr) <= 0) break;
+        sent += rr;
+    }
+    return sent;
+}
+
+/* sendfile() from offset 0. Returns the bytes sent, or -1 if this file
+   cannot be sent that way (nothing has been sent then). */
+long long send_file_zero(int fd, int infd, long long filesize) {
+    off_t off = 0;
+    while (off < filesize) {
+        long long left = filesize - off;
+        ssize_t n = sendfile(fd, infd, &off, left > SENDFILE_CHUNK ? SENDFILE_CHUNK : left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && off == 0 && (errno == EINVAL || errno == ENOSYS)) return -1;
+        if (n <= 0) break;
+    }
+    return off;
+}
+
+/* Old path: through an 8 KB buffer. Returns the bytes written. */
+long long recv_file_copy(int fd, int outfd, long long filesize) {
+    long long remaining = filesize;
+    char buf[BUF];
+    while (remaining > 0) {
+        ssize_t toread = remaining > (long long)sizeof(buf) ? (long long)sizeof(buf) : remaining;
+        ssize_t rec = full_recv(fd, buf, toread);
+        if (rec <= 0) break;
+        if (full_write(outfd, buf, rec) < 0) break;
+        remaining -= rec;
+    }
+    return filesize - remaining;
+}
+
+/* socket -> pipe -> file with splice(). Returns the bytes written, or -1
+   if the file cannot be spliced into (nothing has been read then). */
+long long recv_file_zero(int fd, int outfd, long long filesize) {
+    int p[2];
+    if (pipe(p) < 0) return -1;
+    fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);     // best effort
+
+    long long remaining = filesize;
+    while (remaining > 0) {
+        ssize_t in = splice(fd, NULL, p[1], NULL, remaining > PIPE_SIZE ? PIPE_SIZE : remaining,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in <= 0) break;
+        while (in > 0) {
+            ssize_t out = splice(p[0], NULL, outfd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out < 0 && remaining == filesize && (errno == EINVAL || errno == ENOSYS)) {
+                // the file system takes no splice: write what the pipe holds, go on by copying
+                char buf[BUF];
+                while (in > 0) {
+                    ssize_t r = read(p[0], buf, in > BUF ? BUF : in);
+                    if (r <= 0 || full_write(outfd, buf, r) < 0) break;
+                    in -= r;
+                    remaining -= r;
+                }
+                close(p[0]);
+                close(p[1]);
+                if (in > 0) return filesize - remaining;
+                return (filesize - remaining) + recv_file_copy(fd, outfd, remaining);
+            }
+            if (out <= 0) {
+                close(p[0]);
+                close(p[1]);
+                return filesize - remaining;
+            }
+            in -= out;
+            remaining -= out;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    return filesize - remaining;
+}
+
+void handle_download(Conn *c, const char *clientip, const char *filename) {
+    int fd = c->fd;
+    // build full path
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", server_dir, filename);
+    int infd = open(path, O_RDONLY);
+    if (infd < 0) {
+        char resp[256];
+        snprintf(resp, sizeof(resp), "ERR|%s\n", strerror(errno));
+        send(fd, resp, strlen(resp), 0);
+        return;
+    }
+    struct stat st;
+    fstat(infd, &st);
+    off_t filesize = st.st_size;
+    char resp[256];
+    snprintf(resp, sizeof(resp), "OK|%lld\n", (long long)filesize);
+    send(fd, resp, strlen(resp), 0);
+
+    // start timer on server side
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_REALTIME, &t_start);
+
+    // send file
+    long long sent = copy_mode ? -1 : send_file_zero(fd, infd, filesize);
+    if (sent < 0) sent = send_file_copy(fd, infd);
+
+    clock_gettime(CLOCK_REALTIME, &t_end);
+    double secs = timediff_sec(t_end, t_start);
+    printf("Sent file %s (%lld bytes) to %s:%d in %.6f s (%.3f GB/s)\n", filename, sent, clientip,
+           ntohs(c->cli.sin_port), secs, secs > 0 ? sent / secs / 1e9 : 0);
+    close(infd);
+}
+
+/* pre: bytes of the file that came in with the header */
+void handle_upload(Conn *c, const char *clientip, char *args, const char *pre, size_t prelen) {
+    int fd = c->fd;
+    // format: UPLOAD|filename|filesize
+    char *p2 = strchr(args, '|');
+    if (!p2) {
+        send(fd, "ERR|bad_upload_header\n", 22, 0);
+        return;
+    }
+    *p2 = 0;
+    char *filename = args;
+    long long filesize = atoll(p2 + 1);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", server_dir, filename);
+    int outfd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (outfd < 0) {
+        char resp[256];
+        snprintf(resp, sizeof(resp), "ERR|%s\n", strerror(errno));
+        send(fd, resp, strlen(resp), 0);
+        return;
+    }
+    send(fd, "OK\n", 3, 0);
+
+    // receive file and measure
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_REALTIME, &t_start);
+
+    long long got = 0;
+    if (prelen > (size_t)filesize) prelen = filesize;
+    if (prelen > 0 && full_write(outfd, pre, prelen) == (ssize_t)prelen) got = prelen;
+    if (got == (long long)prelen) {
+        long long n = copy_mode ? -1 : recv_file_zero(fd, outfd, filesize - got);
+        if (n < 0) n = recv_file_copy(fd, outfd, filesize - got);
+        got += n;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &t_end);
+    double secs = timediff_sec(t_end, t_start);
+    printf("Received file %s (%lld bytes) from %s:%d in %.6f s (%.3f GB/s)\n", filename, got, clientip,
+           ntohs(c->cli.sin_port), secs, secs > 0 ? got / secs / 1e9 : 0);
+
+    close(outfd);
+}
+
+void *client_handler(void *arg) {
+    Conn *c = arg;
+    int fd = c->fd;
+    char clientip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(c->cli.sin_addr), clientip, sizeof(clientip));
+    printf("Accepted connection from %s:%d\n", clientip, ntohs(c->cli.sin_port));
+
+    // read a command line (ending with '\n'), however it is split into segments
+    char hdr[HDR_MAX];
+    size_t len = 0;
+    char *nl = NULL;
+    while (!nl && len < sizeof(hdr) - 1) {
+        ssize_t r = recv(fd, hdr + len, sizeof(hdr) - 1 - len, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        len += r;
+        hdr[len] = 0;
+        nl = strchr(hdr, '\n');
+    }
+    if (len == 0) {
+        close(fd);
+        free(c);
+        return NULL;
+    }
+    hdr[len] = 0;
+    // only consider up to newline
+    if (nl) *nl = 0;
+    char *rest = nl ? nl + 1 : hdr + len;
+    size_t restlen = hdr + len - rest;
+
+    // parse
+    if (strncmp(hdr, "DOWNLOAD|", 9) == 0) {
+        handle_download(c, clientip, hdr + 9);
+    } else if (strncmp(hdr, "UPLOAD|", 7) == 0) {
+        handle_upload(c, clientip, hdr + 7, rest, restlen);
+    } else {
+        send(fd, "ERR|unknown_command\n", 20, 0);
+    }
+    close(fd);
+    free(c);
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <server_directory>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> <server_directory> [-c]\n", argv[0]);
         return 1;
     }
     int port = atoi(argv[1]);
-    const char *server_dir = argv[2];
+    server_dir = argv[2];
+    copy_mode = argc > 3 && strcmp(argv[3], "-c") == 0;
 
     // create dir if not exists
     mkdir(server_dir, 0755);
 
+    // A client that goes away mid-transfer must only end its own thread's
+    // send/sendfile with EPIPE, not kill every transfer in flight
+    signal(SIGPIPE, SIG_IGN);
+
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) { perror("socket"); return 1; }
 
@@ -71,117 +315,26 @@ int main(int argc, char *argv[]) {
     if (bind(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) { perror("bind"); return 1; }
     if (listen(sock, BACKLOG) < 0) { perror("listen"); return 1; }
 
-    printf("File server listening on port %d, dir=%s\n", port, server_dir);
+    printf("File server listening on port %d, dir=%s (%s)\n", port, server_dir,
+           copy_mode ? "8 KB copies" : "sendfile/splice");
 
     while (1) {
-        struct sockaddr_in cli;
-        socklen_t clilen = sizeof(cli);
-        int fd = accept(sock, (struct sockaddr*)&cli, &clilen);
-        if (fd < 0) { perror("accept"); continue; }
-
-        char clientip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(cli.sin_addr), clientip, sizeof(clientip));
-        printf("Accepted connection from %s:%d\n", clientip, ntohs(cli.sin_port));
-
-        // read a command line (ending with '\n')
-        char hdr[512];
-        ssize_t r = recv(fd, hdr, sizeof(hdr)-1, 0);
-        if (r <= 0) { close(fd); continue; }
-        hdr[r] = 0;
-        // only consider up to newline
-        char *nl = strchr(hdr, '\n');
-        if (nl) *nl = 0;
-
-        // parse
-        if (strncmp(hdr, "DOWNLOAD|", 9) == 0) {
-            char *filename = hdr + 9;
-            // build full path
-            char path[1024];
-            snprintf(path, sizeof(path), "%s/%s", server_dir, filename);
-            int infd = open(path, O_RDONLY);
-            if (infd < 0) {
-                char resp[256];
-                snprintf(resp, sizeof(resp), "ERR|%s\n", strerror(errno));
-                send(fd, resp, strlen(resp), 0);
-                close(fd);
-                continue;
-            }
-            struct stat st;
-            fstat(infd, &st);
-            off_t filesize = st.st_size;
-            char resp[256];
-            snprintf(resp, sizeof(resp), "OK|%lld\n", (long long)filesize);
-            send(fd, resp, strlen(resp), 0);
-
-            // start timer on server side
-            struct timespec t_start, t_end;
-            clock_gettime(CLOCK_REALTIME, &t_start);
-
-            // send file
-            char buf[BUF];
-            ssize_t rr;
-            while ((rr = read(infd, buf, sizeof(buf))) > 0) {
-                if (full_send(fd, buf, rr) <= 0) break;
-            }
-            clock_gettime(CLOCK_REALTIME, &t_end);
-            double secs = timediff_sec(t_end, t_start);
-            printf("Sent file %s (%lld bytes) to %s:%d in %.6f s\n", filename, (long long)filesize, clientip, ntohs(cli.sin_port), secs);
-            // also send server-side timing info as a final small message? Not necessary — client times too.
-
-            close(infd);
-            close(fd);
-        }
-        else if (strncmp(hdr, "UPLOAD|", 7) == 0) {
-            // format: UPLOAD|filename|filesize
-            char *p = hdr + 7;
-            char *p2 = strchr(p, '|');
-            if (!p2) {
-                send(fd, "ERR|bad_upload_header\n", 22, 0);
-                close(fd); continue;
-            }
-            *p2 = 0;
-            char *filename = p;
-            long long filesize = atoll(p2 + 1);
-            char path[1024];
-            snprintf(path, sizeof(path), "%s/%s", server_dir, filename);
-            int outfd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-            if (outfd < 0) {
-                char resp[256];
-                snprintf(resp, sizeof(resp), "ERR|%s\n", strerror(errno));
-                send(fd, resp, strlen(resp), 0);
-                close(fd); continue;
-            }
-            send(fd, "OK\n", 3, 0);
-
-            // receive file and measure
-            struct timespec t_start, t_end;
-            clock_gettime(CLOCK_REALTIME, &t_start);
-
-            long long remaining = filesize;
-            char buf[BUF];
-            while (remaining > 0) {
-                ssize_t toread = remaining > sizeof(buf) ? sizeof(buf) : remaining;
-                ssize_t rec = full_recv(fd, buf, toread);
-                if (rec <= 0) { break; }
-                write(outfd, buf, rec);
-                remaining -= rec;
-            }
-
-            clock_gettime(CLOCK_REALTIME, &t_end);
-            double secs = timediff_sec(t_end, t_start);
-            printf("Received file %s (%lld bytes) from %s:%d in %.6f s\n", filename, filesize - remaining, clientip, ntohs(cli.sin_port), secs);
+        Conn *c = malloc(sizeof(Conn));
+        if (!c) { perror("malloc"); sleep(1); continue; }
+        socklen_t clilen = sizeof(c->cli);
+        c->fd = accept(sock, (struct sockaddr*)&c->cli, &clilen);
+        if (c->fd < 0) { perror("accept"); free(c); continue; }
 
-            close(outfd);
-            close(fd);
-        }
-        else {
-            send(fd, "ERR|unknown_command\n", 20, 0);
-            close(fd);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, client_handler, c) != 0) {
+            perror("Thread error");
+            close(c->fd);
+            free(c);
+            continue;
         }
+        pthread_detach(tid);
     }
 
     close(sock);
     return 0;
 }
-
-
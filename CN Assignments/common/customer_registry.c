@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "customer_registry.h"
+
+#define SHARDS 64
+#define INITIAL_SLOTS 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    Customer **slots;
+    size_t mask;
+    size_t used;
+} Shard;
+
+static Shard shards[SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_int count;
+static Customer *_Atomic listed[CUSTOMER_LIST_MAX];
+
+static void init_shards(void) {
+    for(int i = 0; i < SHARDS; i++) pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static unsigned hash_id(int id) {
+    unsigned h = (unsigned)id;   // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Low bits pick the shard, the rest the slot within it
+static Shard *shard_of(unsigned h) {
+    return &shards[h % SHARDS];
+}
+
+static Customer **probe(Shard *s, int id, unsigned h) {
+    size_t i = (h / SHARDS) & s->mask;
+    while(s->slots[i] && s->slots[i]->id != id) i = (i + 1) & s->mask;
+    return &s->slots[i];
+}
+
+static int grow(Shard *s) {
+    size_t nslots = s->slots ? (s->mask + 1) * 2 : INITIAL_SLOTS;
+    Customer **old = s->slots;
+    size_t old_n = s->slots ? s->mask + 1 : 0;
+
+    s->slots = calloc(nslots, sizeof(Customer *));
+    if(!s->slots) {
+        s->slots = old;
+        return -1;
+    }
+    s->mask = nslots - 1;
+    for(size_t i = 0; i < old_n; i++)
+        if(old[i]) *probe(s, old[i]->id, hash_id(old[i]->id)) = old[i];
+    free(old);
+    return 0;
+}
+
+Customer *customer_get(int id, int *is_new) {
+    pthread_once(&shards_once, init_shards);
+    unsigned h = hash_id(id);
+    Shard *s = shard_of(h);
+    *is_new = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if((s->used + 1) * 2 > (s->slots ? s->mask + 1 : 0) && grow(s) < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    Customer **slot = probe(s, id, h);
+    Customer *c = *slot;
+    if(!c && (c = calloc(1, sizeof(Customer)))) {
+        c->id = id;
+        *slot = c;
+        s->used++;
+        *is_new = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if(*is_new) {
+        int seq = atomic_fetch_add(&count, 1);
+        if(seq < CUSTOMER_LIST_MAX) atomic_store(&listed[seq], c);
+    }
+    return c;
+}
+
+Customer *customer_find(int id) {
+    pthread_once(&shards_once, init_shards);
+    unsigned h = hash_id(id);
+    Shard *s = shard_of(h);
+
+    pthread_mutex_lock(&s->lock);
+    Customer *c = s->slots ? *probe(s, id, h) : NULL;
+    pthread_mutex_unlock(&s->lock);
+    return c;
+}
+
+int customer_count(void) {
+    return atomic_load(&count);
+}
+
+Customer *customer_listed(int i) {
+    return i < CUSTOMER_LIST_MAX ? atomic_load(&listed[i]) : NULL;
+}
+
+void customer_seen(Customer *c, long bytes) {
+    atomic_fetch_add_explicit(&c->bytes, bytes, memory_order_relaxed);
+    atomic_store_explicit(&c->last_seen, time(NULL), memory_order_relaxed);
+}
+
+void customer_purchased(Customer *c) {
+    atomic_fetch_add_explicit(&c->purchases, 1, memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+#ifndef CUSTOMER_REGISTRY_H
+#define CUSTOMER_REGISTRY_H
+
+// Customers seen by the fruit stores, keyed by customer ID.
+//
+// A concurrent hash set split into independently locked shards, each an
+// open-addressing table that doubles when half full, so insert/lookup are
+// O(1) with no upper limit on customers. Counters on a Customer are atomics
+// and can be bumped without any lock once the pointer is held.
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define CUSTOMER_LIST_MAX 100   // customers shown by name in the stock listing
+
+typedef struct {
+    int id;
+    atomic_long purchases;
+    atomic_long bytes;          // request + reply bytes exchanged
+    _Atomic time_t last_seen;
+} Customer;
+
+// Returns the customer, adding it first if new (*is_new set to 1).
+// NULL only if out of memory.
+Customer *customer_get(int id, int *is_new);
+Customer *customer_find(int id);
+
+int customer_count(void);
+// The first CUSTOMER_LIST_MAX customers in arrival order; NULL while the
+// i-th one is still being published.
+Customer *customer_listed(int i);
+
+void customer_seen(Customer *c, long bytes);
+void customer_purchased(Customer *c);
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include "fruit_catalog.h"
+
+#define INITIAL_SLOTS 16
+#define INITIAL_ITEMS 16
+
+typedef struct {
+    size_t mask;
+    Fruit *_Atomic slots[];
+} Table;
+
+// Readers load these without locking. Arrays replaced on growth are kept on
+// a retired list instead of freed, since a reader may still be walking one;
+// growth is geometric so they add at most the size of the live arrays.
+static Table *_Atomic table;
+static Fruit *_Atomic *_Atomic items;
+static atomic_int count;
+static size_t items_cap;
+
+typedef struct Retired {
+    struct Retired *next;
+    void *mem;
+} Retired;
+
+static Retired *retired;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_name(const char *name) {
+    unsigned h = 2166136261u;   // FNV-1a over the case-folded name
+    for(const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= (unsigned)tolower(*p);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void retire(void *mem) {
+    Retired *r = malloc(sizeof(Retired));
+    if(!r) return;   // leak rather than free memory a reader may hold
+    r->mem = mem;
+    r->next = retired;
+    retired = r;
+}
+
+static Table *new_table(size_t nslots) {
+    Table *t = calloc(1, sizeof(Table) + nslots * sizeof(Fruit *));
+    if(t) t->mask = nslots - 1;
+    return t;
+}
+
+static void table_put(Table *t, Fruit *f) {
+    size_t i = f->hash & t->mask;
+    while(atomic_load_explicit(&t->slots[i], memory_order_relaxed))
+        i = (i + 1) & t->mask;
+    atomic_store_explicit(&t->slots[i], f, memory_order_release);
+}
+
+static Fruit *table_get(Table *t, const char *name, unsigned h) {
+    if(!t) return NULL;
+    for(size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+        Fruit *f = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+        if(!f) return NULL;
+        if(f->hash == h && strcasecmp(f->name, name) == 0) return f;
+    }
+}
+
+// Caller holds write_lock. Keeps the load factor at or below 1/2.
+static int reserve(int n) {
+    Table *t = atomic_load_explicit(&table, memory_order_relaxed);
+    if(!t || (size_t)n * 2 > t->mask + 1) {
+        size_t nslots = t ? (t->mask + 1) * 2 : INITIAL_SLOTS;
+        while((size_t)n * 2 > nslots) nslots *= 2;
+        Table *nt = new_table(nslots);
+        if(!nt) return -1;
+        Fruit *_Atomic *cur = atomic_load_explicit(&items, memory_order_relaxed);
+        int cnt = atomic_load_explicit(&count, memory_order_relaxed);
+        for(int i = 0; i < cnt; i++) table_put(nt, atomic_load_explicit(&cur[i], memory_order_relaxed));
+        atomic_store_explicit(&table, nt, memory_order_release);
+        if(t) retire(t);
+    }
+
+    if((size_t)n > items_cap) {
+        size_t cap = items_cap ? items_cap * 2 : INITIAL_ITEMS;
+        while((size_t)n > cap) cap *= 2;
+        Fruit *_Atomic *old = atomic_load_explicit(&items, memory_order_relaxed);
+        Fruit *_Atomic *ni = calloc(cap, sizeof(Fruit *));
+        if(!ni) return -1;
+        int cnt = atomic_load_explicit(&count, memory_order_relaxed);
+        for(int i = 0; i < cnt; i++)
+            atomic_init(&ni[i], atomic_load_explicit(&old[i], memory_order_relaxed));
+        atomic_store_explicit(&items, ni, memory_order_release);
+        items_cap = cap;
+        if(old) retire(old);
+    }
+    return 0;
+}
+
+Fruit *add_fruit(const char *name, int qty) {
+    unsigned h = hash_name(name);
+
+    pthread_mutex_lock(&write_lock);
+    Fruit *f = table_get(atomic_load_explicit(&table, memory_order_relaxed), name, h);
+    if(f) {
+        pthread_mutex_unlock(&write_lock);
+        restock_fruit(f, qty);
+        return f;
+    }
+
+    int n = atomic_load_explicit(&count, memory_order_relaxed);
+    if(reserve(n + 1) < 0 || !(f = aligned_alloc(64, sizeof(Fruit)))) {
+        pthread_mutex_unlock(&write_lock);
+        return NULL;
+    }
+    memset(f, 0, sizeof(Fruit));
+    strncpy(f->name, name, sizeof(f->name) - 1);
+    atomic_init(&f->qty, qty);
+    atomic_init(&f->last_sold, 0);
+    f->hash = h;
+    f->index = n;
+
+    // Listing slot first, then the count, then the hash table entry, so any
+    // reader that can see the fruit can also see everything before it
+    atomic_store_explicit(&atomic_load_explicit(&items, memory_order_relaxed)[n], f, memory_order_relaxed);
+    atomic_store_explicit(&count, n + 1, memory_order_release);
+    table_put(atomic_load_explicit(&table, memory_order_relaxed), f);
+    pthread_mutex_unlock(&write_lock);
+    return f;
+}
+
+void init_fruits(void) {
+    add_fruit("Apple", 100);
+    add_fruit("Banana", 150);
+    add_fruit("Orange", 80);
+    add_fruit("Mango", 60);
+    add_fruit("Grapes", 120);
+}
+
+int load_fruits(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) return -1;
+
+    char line[256], name[50];
+    int qty, loaded = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        if(line[0] == '#') continue;
+        if(sscanf(line, "%49s %d", name, &qty) != 2) continue;
+        if(add_fruit(name, qty)) loaded++;
+    }
+    fclose(fp);
+    return loaded;
+}
+
+Fruit *find_fruit(const char *name) {
+    return table_get(atomic_load_explicit(&table, memory_order_acquire), name, hash_name(name));
+}
+
+int fruit_count(void) {
+    return atomic_load_explicit(&count, memory_order_acquire);
+}
+
+Fruit *fruit_at(int i) {
+    return atomic_load_explicit(&atomic_load_explicit(&items, memory_order_acquire)[i], memory_order_relaxed);
+}
+
+static int take(Fruit *f, int qty, int *left) {
+    int cur = atomic_load_explicit(&f->qty, memory_order_relaxed);
+    do {
+        // qty <= 0 would add stock (or overflow) through a purchase
+        if(qty <= 0 || cur < qty) {
+            *left = cur;
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&f->qty, &cur, cur - qty,
+                                                   memory_order_acq_rel, memory_order_relaxed));
+    *left = cur - qty;
+    return 1;
+}
+
+int buy_fruit(Fruit *f, int qty, int *left) {
+    if(!take(f, qty, left)) return 0;
+    atomic_store_explicit(&f->last_sold, time(NULL), memory_order_relaxed);
+    return 1;
+}
+
+int buy_order(OrderLine *lines, int *n, int *short_line, int *left) {
+    // Insertion sort: baskets are small
+    for(int i = 1; i < *n; i++) {
+        OrderLine l = lines[i];
+        int j = i;
+        for(; j > 0 && lines[j - 1].fruit->index > l.fruit->index; j--) lines[j] = lines[j - 1];
+        lines[j] = l;
+    }
+    int m = 0, too_many = -1;
+    for(int i = 0; i < *n; i++) {
+        if(m > 0 && lines[m - 1].fruit == lines[i].fruit) {
+            // Summed wide: two big lines must not wrap into a small quantity
+            long long sum = (long long)lines[m - 1].qty + lines[i].qty;
+            if(sum > INT_MAX) {
+                too_many = m - 1;
+                sum = INT_MAX;
+            }
+            lines[m - 1].qty = (int)sum;
+        } else lines[m++] = lines[i];
+    }
+    *n = m;
+    if(too_many >= 0) {
+        *short_line = too_many;
+        *left = atomic_load_explicit(&lines[too_many].fruit->qty, memory_order_relaxed);
+        return 0;
+    }
+
+    for(int i = 0; i < m; i++) {
+        if(!take(lines[i].fruit, lines[i].qty, left)) {
+            for(int j = 0; j < i; j++) restock_fruit(lines[j].fruit, lines[j].qty);
+            *short_line = i;
+            return 0;
+        }
+    }
+    time_t now = time(NULL);
+    for(int i = 0; i < m; i++)
+        atomic_store_explicit(&lines[i].fruit->last_sold, now, memory_order_relaxed);
+    return 1;
+}
+
+void restock_fruit(Fruit *f, int qty) {
+    atomic_fetch_add_explicit(&f->qty, qty, memory_order_relaxed);
+}
+
+void fruit_last_sold(const Fruit *f, char *buf, size_t n) {
+    time_t t = atomic_load_explicit(&f->last_sold, memory_order_relaxed);
+    if(t == 0) {
+        snprintf(buf, n, "Never");
+        return;
+    }
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, n, "%H:%M:%S", &tm);
+}
@@ -0,0 +1,58 @@
+#ifndef FRUIT_CATALOG_H
+#define FRUIT_CATALOG_H
+
+// Fruit catalog shared by the TCP (Assignment 2) and UDP (Assignment 3) stores.
+//
+// Items live in an open-addressing hash table keyed by the case-folded name,
+// so find_fruit() is O(1) however many SKUs are loaded. The table grows at
+// runtime; lookups and purchases never take a lock, only adding an item does.
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// One cache line per fruit so buyers of different fruits never share a line.
+// A Fruit never moves or goes away once added, so pointers to it stay valid.
+typedef struct {
+    _Alignas(64) atomic_int qty;
+    _Atomic time_t last_sold;   // 0 = never sold
+    unsigned hash;
+    int index;                  // position in listing order
+    char name[50];
+} Fruit;
+
+void init_fruits(void);                 // the five default fruits
+int load_fruits(const char *path);      // "name qty" per line, '#' comments; -1 on error
+Fruit *add_fruit(const char *name, int qty);   // restocks if the name exists
+
+Fruit *find_fruit(const char *name);
+int fruit_count(void);
+Fruit *fruit_at(int i);
+
+// Compare-and-swap decrement. Returns 1 and stamps last_sold on success;
+// returns 0 and leaves stock untouched if fewer than qty are left, with the
+// quantity seen in *left (for the REGRET message). qty <= 0 always fails.
+int buy_fruit(Fruit *f, int qty, int *left);
+void restock_fruit(Fruit *f, int qty);
+
+#define MAX_ORDER_LINES 20
+
+typedef struct {
+    Fruit *fruit;
+    int qty;                    // > 0
+} OrderLine;
+
+// All-or-nothing purchase of a basket. Lines are sorted into a canonical
+// (catalog index) order and duplicate fruits merged, in place; *n becomes
+// the merged count. Each line is then reserved with a CAS decrement; if one
+// is short, the reservations already taken are given back and 0 is
+// returned with that line's index in *short_line and its stock in *left.
+// A fruit whose merged quantity passes INT_MAX fails the same way, with its
+// qty left at INT_MAX, before anything is reserved.
+// Lock-free, so two overlapping orders can never deadlock, and the shared
+// order means they cannot both take one item each and both fail.
+int buy_order(OrderLine *lines, int *n, int *short_line, int *left);
+
+void fruit_last_sold(const Fruit *f, char *buf, size_t n);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef FRUIT_LOAD_H
+#define FRUIT_LOAD_H
+
+// Pieces shared by the fruit store load generators (fruit_loadgen.c and
+// Assignment 3/udp_fruit_load.c): the UDP store's wire structs, a fast
+// per-thread RNG and the catalog file reader.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define FRUIT_UDP_MAX 1024      // message size, as MAX in udp_fruit_store_server.c
+#define MAX_ORDER_LINES 20
+#define MAX_FRUITS 100000
+
+// UDP wire structs, as in udp_fruit_store_server.c. Requests for actions
+// 1-3 need only the part before nlines, and an order only its used lines.
+typedef struct {
+    char fruit_name[50];
+    int qty;
+} OrderItem;
+
+typedef struct {
+    int id;
+    char fruit_name[50];
+    int qty;
+    int action; // 1=view_stock, 2=purchase, 3=exit, 4=order
+    unsigned seq;
+    int nlines;
+    OrderItem lines[MAX_ORDER_LINES];
+} Request;
+
+typedef struct {
+    int success;
+    unsigned seq;
+    char message[FRUIT_UDP_MAX];
+} Response;
+
+// xorshift64*; seed with anything but 0
+static inline uint64_t rng_next(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+// Uniform in [0, 1)
+static inline double rng_unit(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Fruit names from a catalog file ("name qty" per line, '#' comments, as
+// for the servers' -c), or the five default fruits if path is NULL.
+// Returns how many were read into a new *names, or -1.
+static inline int load_names(const char *path, char (**names)[50]) {
+    static const char *defaults[] = { "Apple", "Banana", "Orange", "Mango", "Grapes" };
+    int n = 0;
+    *names = malloc(MAX_FRUITS * sizeof(**names));
+    if(!*names) return -1;
+    if(!path) {
+        for(; n < 5; n++) strcpy((*names)[n], defaults[n]);
+        return n;
+    }
+    FILE *fp = fopen(path, "r");
+    if(!fp) return -1;
+    char line[256];
+    int qty;
+    while(n < MAX_FRUITS && fgets(line, sizeof(line), fp)) {
+        if(line[0] == '#') continue;
+        if(sscanf(line, "%49s %d", (*names)[n], &qty) == 2) n++;
+    }
+    fclose(fp);
+    return n > 0 ? n : -1;
+}
+
+#endif
@@ -0,0 +1,300 @@
+// Closed-loop load generator for the TCP (server2) and UDP (server3) fruit stores.
+// Compile: gcc -O2 fruit_loadgen.c -o fruit_loadgen -pthread -lm
+// Run: ./fruit_loadgen [-p tcp|udp] [-s server_ip] [-n customers] [-d seconds]
+//                      [-t think_ms] [-z zipf_s] [-o order_size] [-v view_pct] [-f catalog_file]
+//   -n - concurrent customers, one thread each (default 16)
+//   -t - mean think time between requests, exponentially distributed (default 0)
+//   -z - popularity skew: fruit k is bought with weight 1/k^s (default 0.99, 0 = uniform)
+//   -o - fruits per request: 1 is a plain purchase, more is one all-or-nothing order
+//   -v - percentage of requests that view the stock instead of buying
+//   -f - fruit names to buy ("name qty" per line, as for the servers' -c);
+//        default the five default fruits
+//
+// Every customer sends one request, waits for the answer, thinks, and
+// repeats. TCP customers use the binary protocol (fruit_proto.h); UDP
+// customers retransmit nothing and count a reply missing after 1 s as lost.
+// Reports throughput and the latency distribution of every request.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include "../Assignment 2/fruit_proto.h"
+#include "latency_hist.h"
+#include "fruit_load.h"
+
+#define PORT 8080
+
+typedef struct {
+    int idx;
+    LatencyHist hist;
+    long ok, regret, failed, lost;
+} Shopper;
+
+const char *server_ip = "127.0.0.1";
+int use_udp = 0, order_size = 1, view_pct = 0;
+double think_ms = 0, zipf_s = 0.99;
+atomic_int running = 1;
+
+char (*names)[50];
+double *cdf;    // cdf[k] = P(fruit <= k)
+int nnames;
+
+const char *pick_fruit(uint64_t *s) {
+    double u = rng_unit(s);
+    int lo = 0, hi = nnames - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return names[lo];
+}
+
+void think(uint64_t *s) {
+    if(think_ms <= 0) return;
+    double ms = -think_ms * log(1 - rng_unit(s));
+    usleep((useconds_t)(ms * 1000));
+}
+
+int connect_to(int type) {
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, type, 0);
+    if(sock < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, server_ip, &addr.sin_addr);
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int send_all(int sock, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t s = send(sock, buf, len, 0);
+        if(s <= 0) return -1;
+        buf += s;
+        len -= s;
+    }
+    return 0;
+}
+
+void run_tcp(Shopper *sh, uint64_t *rng) {
+    static _Thread_local char in[4 + FRAME_MAX];
+    char out[FRAME_HDR + 1 + MAX_ORDER_LINES * 55];
+    size_t in_len = 0, len;
+    uint8_t type;
+    uint32_t plen;
+    const char *payload;
+
+    int sock = connect_to(SOCK_STREAM);
+    if(sock < 0) {
+        sh->failed++;
+        return;
+    }
+    put_u32(out, PROTO_MAGIC);
+    frame_header(out + 4, FT_HELLO, 4);
+    put_u32(out + 4 + FRAME_HDR, (uint32_t)(1000 + sh->idx));
+    send_all(sock, out, 4 + FRAME_HDR + 4);
+
+    while(running) {
+        think(rng);
+        int view = (int)(rng_next(rng) % 100) < view_pct;
+        if(view) {
+            frame_header(out, FT_STOCK, 0);
+            len = FRAME_HDR;
+        } else {
+            len = FRAME_HDR + (order_size > 1);
+            for(int i = 0; i < order_size; i++) {
+                const char *name = pick_fruit(rng);
+                size_t n = strlen(name);
+                put_u32(out + len, 1);
+                out[len + 4] = (char)n;
+                memcpy(out + len + 5, name, n);
+                len += 5 + n;
+            }
+            frame_header(out, order_size > 1 ? FT_ORDER : FT_BUY, len - FRAME_HDR);
+            if(order_size > 1) out[FRAME_HDR] = (char)order_size;
+        }
+
+        uint64_t start = now_ns();
+        if(send_all(sock, out, len) < 0) break;
+        long n;
+        while((n = frame_parse(in, in_len, &type, &payload, &plen)) == 0) {
+            ssize_t r = recv(sock, in + in_len, sizeof(in) - in_len, 0);
+            if(r <= 0) {
+                n = -1;
+                break;
+            }
+            in_len += r;
+        }
+        if(n < 0) break;
+        hist_record(&sh->hist, now_ns() - start);
+
+        if(type == FT_STOCK_REPLY || (type == FT_RESULT && plen > 0 && payload[0] == RS_OK)) sh->ok++;
+        else if(type == FT_RESULT && plen > 0 && payload[0] == RS_REGRET) sh->regret++;
+        else sh->failed++;
+        memmove(in, in + n, in_len - n);
+        in_len -= n;
+    }
+    if(running) sh->failed++;   // dropped by the server
+    close(sock);
+}
+
+void run_udp(Shopper *sh, uint64_t *rng) {
+    Request req;
+    Response res;
+    struct timeval tv = {1, 0};
+    unsigned seq = (unsigned)rng_next(rng);
+
+    int sock = connect_to(SOCK_DGRAM);
+    if(sock < 0) {
+        sh->failed++;
+        return;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while(running) {
+        think(rng);
+        memset(&req, 0, sizeof(req));
+        req.id = 1000 + sh->idx;
+        if(++seq == 0) seq = 1;
+        req.seq = seq;
+        size_t len = offsetof(Request, nlines);
+        if((int)(rng_next(rng) % 100) < view_pct) {
+            req.action = 1;
+        } else if(order_size == 1) {
+            req.action = 2;
+            req.qty = 1;
+            strcpy(req.fruit_name, pick_fruit(rng));
+        } else {
+            req.action = 4;
+            req.nlines = order_size;
+            for(int i = 0; i < order_size; i++) {
+                strcpy(req.lines[i].fruit_name, pick_fruit(rng));
+                req.lines[i].qty = 1;
+            }
+            len = offsetof(Request, lines) + order_size * sizeof(OrderItem);
+        }
+
+        uint64_t start = now_ns();
+        if(send(sock, &req, len, 0) < 0) {
+            sh->failed++;
+            continue;
+        }
+        ssize_t n;
+        while((n = recv(sock, &res, sizeof(res) - 1, 0)) >= (ssize_t)offsetof(Response, message) &&
+              res.seq != req.seq)
+            ;   // a late reply to an earlier, already lost request
+        if(n < (ssize_t)offsetof(Response, message)) {
+            sh->lost++;
+            continue;
+        }
+        hist_record(&sh->hist, now_ns() - start);
+        ((char*)&res)[n] = 0;
+        if(res.success) sh->ok++;
+        else if(strstr(res.message, "REGRET")) sh->regret++;
+        else sh->failed++;
+    }
+    close(sock);
+}
+
+void* shopper(void* arg) {
+    Shopper *sh = arg;
+    uint64_t rng = 0x9E3779B97F4A7C15ull * (sh->idx + 1) ^ (uint64_t)now_ns();
+    if(use_udp) run_udp(sh, &rng);
+    else run_tcp(sh, &rng);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nshoppers = 16, secs = 10, opt;
+    const char *catalog = NULL;
+
+    while((opt = getopt(argc, argv, "p:s:n:d:t:z:o:v:f:")) != -1) {
+        if(opt == 'p') use_udp = strcmp(optarg, "udp") == 0;
+        else if(opt == 's') server_ip = optarg;
+        else if(opt == 'n') nshoppers = atoi(optarg);
+        else if(opt == 'd') secs = atoi(optarg);
+        else if(opt == 't') think_ms = atof(optarg);
+        else if(opt == 'z') zipf_s = atof(optarg);
+        else if(opt == 'o') order_size = atoi(optarg);
+        else if(opt == 'v') view_pct = atoi(optarg);
+        else if(opt == 'f') catalog = optarg;
+        else {
+            printf("Usage: %s [-p tcp|udp] [-s server_ip] [-n customers] [-d seconds] "
+                   "[-t think_ms] [-z zipf_s] [-o order_size] [-v view_pct] [-f catalog_file]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(nshoppers < 1) nshoppers = 1;
+    if(secs < 1) secs = 1;
+    if(order_size < 1) order_size = 1;
+    if(order_size > MAX_ORDER_LINES) order_size = MAX_ORDER_LINES;
+
+    if((nnames = load_names(catalog, &names)) < 0) {
+        perror("Catalog load failed");
+        exit(1);
+    }
+    cdf = malloc(nnames * sizeof(double));
+    double sum = 0;
+    for(int k = 0; k < nnames; k++) sum += 1 / pow(k + 1, zipf_s);
+    double acc = 0;
+    for(int k = 0; k < nnames; k++) {
+        acc += 1 / pow(k + 1, zipf_s) / sum;
+        cdf[k] = acc;
+    }
+    cdf[nnames - 1] = 1;
+
+    Shopper *sh = calloc(nshoppers, sizeof(Shopper));
+    pthread_t *tids = malloc(nshoppers * sizeof(pthread_t));
+    if(!sh || !tids) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    for(int i = 0; i < nshoppers; i++) {
+        sh[i].idx = i;
+        hist_init(&sh[i].hist);
+        if(pthread_create(&tids[i], NULL, shopper, &sh[i]) != 0) {
+            perror("Thread creation failed");
+            exit(1);
+        }
+    }
+    sleep(secs);
+    running = 0;
+
+    LatencyHist all;
+    long ok = 0, regret = 0, failed = 0, lost = 0;
+    hist_init(&all);
+    for(int i = 0; i < nshoppers; i++) {
+        pthread_join(tids[i], NULL);
+        hist_merge(&all, &sh[i].hist);
+        ok += sh[i].ok;
+        regret += sh[i].regret;
+        failed += sh[i].failed;
+        lost += sh[i].lost;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%s, %d customers, think %.1f ms, zipf %.2f over %d fruits, %d per request, %d%% views\n",
+           use_udp ? "udp" : "tcp", nshoppers, think_ms, zipf_s, nnames, order_size, view_pct);
+    printf("requests: %llu answered (%ld ok, %ld regret, %ld failed), %ld lost, %.0f req/s\n",
+           (unsigned long long)all.total, ok, regret, failed, lost, all.total / elapsed);
+    if(all.total > 0) {
+        printf("latency us: mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n\n",
+               all.sum / all.total / 1e3, hist_quantile(&all, 0.5) / 1e3, hist_quantile(&all, 0.99) / 1e3,
+               hist_quantile(&all, 0.999) / 1e3, all.max / 1e3);
+        hist_print(&all, stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values (nanoseconds) below 64 get a bucket each; above that every power of
+// two is split into 32 buckets, so any recorded value is off by at most
+// 1/32 (~3%) while the whole range up to 2^40 ns fits in ~1.1k counters.
+// Recording is one shift and an increment; keep one histogram per thread
+// and hist_merge() them at the end.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS) * HIST_SUB + 2 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, min, max;
+    double sum;
+} LatencyHist;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline void hist_init(LatencyHist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t v) {
+    if(v < 2 * HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int i = (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// Highest value that lands in bucket i
+static inline uint64_t hist_value(int i) {
+    if(i < 2 * HIST_SUB) return (uint64_t)i;
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+static inline void hist_record(LatencyHist *h, uint64_t ns) {
+    h->counts[hist_index(ns)]++;
+    h->total++;
+    h->sum += (double)ns;
+    if(ns < h->min) h->min = ns;
+    if(ns > h->max) h->max = ns;
+}
+
+static inline void hist_merge(LatencyHist *dst, const LatencyHist *src) {
+    for(int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if(src->min < dst->min) dst->min = src->min;
+    if(src->max > dst->max) dst->max = src->max;
+}
+
+// Value at quantile q (0..1), never above the largest value recorded
+static inline uint64_t hist_quantile(const LatencyHist *h, double q) {
+    if(h->total == 0) return 0;
+    uint64_t want = (uint64_t)(q * h->total + 0.5), seen = 0;
+    if(want < 1) want = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// One line per "half of what is left" quantile (50%, 75%, 87.5%, ...) like
+// HdrHistogram's percentile output, in microseconds
+static inline void hist_print(const LatencyHist *h, FILE *out) {
+    fprintf(out, "%12s %12s %12s %14s\n", "Value(us)", "Percentile", "TotalCount", "1/(1-Percentile)");
+    double q = 0.5;
+    for(int step = 0; step < 20; step++, q += (1 - q) / 2) {
+        uint64_t v = hist_quantile(h, q);
+        uint64_t below = 0;
+        for(int i = 0; i < HIST_BUCKETS && hist_value(i) <= v; i++) below += h->counts[i];
+        fprintf(out, "%12.1f %12.6f %12llu %14.1f\n", v / 1e3, q,
+                (unsigned long long)below, 1 / (1 - q));
+        if((1 - q) * h->total < 1) break;
+    }
+    fprintf(out, "%12.1f %12.6f %12llu %14s\n", h->max / 1e3, 1.0, (unsigned long long)h->total, "inf");
+}
+
+#endif
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "sales_log.h"
+#include "stock_snapshot.h"
+
+static char dir_path[256], snap_path[300], wal_path[300], tmp_path[300];
+static int running;
+static int sync_writes;
+static int wal_fd = -1;
+
+// Purchases hold it shared from the stock change until their record is
+// queued; the snapshot takes it exclusive, so the quantities it copies and
+// the lsn it records always agree.
+static pthread_rwlock_t gate;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed = PTHREAD_COND_INITIALIZER;
+static TextBuf pending, spare;      // records not yet written; the flusher swaps them
+static unsigned long last_lsn;      // last lsn handed out
+static atomic_ulong done_lsn;       // everything up to here is written (and fdatasynced if durable)
+static int watch_fds[SALES_LOG_WATCHERS], nwatch;
+static unsigned long since_snapshot;
+
+static void set_paths(const char *dir) {
+    snprintf(dir_path, sizeof(dir_path), "%s", dir);
+    snprintf(snap_path, sizeof(snap_path), "%s/fruits.snap", dir_path);
+    snprintf(wal_path, sizeof(wal_path), "%s/fruits.wal", dir_path);
+}
+
+// "lsn time lines name qty [name qty ...]"
+static void replay(const char *line, unsigned long snap_lsn) {
+    unsigned long lsn;
+    long t;
+    int n, used, qty;
+    char name[50];
+    if(sscanf(line, "%lu %ld %d%n", &lsn, &t, &n, &used) != 3) return;
+    if(lsn > last_lsn) last_lsn = lsn;
+    if(lsn <= snap_lsn) return;     // already in the snapshot
+
+    const char *p = line + used;
+    for(int i = 0; i < n && sscanf(p, "%49s %d%n", name, &qty, &used) == 2; i++, p += used) {
+        Fruit *f = find_fruit(name);
+        if(!f) continue;
+        restock_fruit(f, -qty);
+        atomic_store_explicit(&f->last_sold, (time_t)t, memory_order_relaxed);
+    }
+}
+
+int sales_log_restore(const char *dir) {
+    char line[4096], name[50];
+    unsigned long snap_lsn;
+    int qty;
+    long last;
+
+    set_paths(dir);
+    FILE *fp = fopen(snap_path, "r");
+    if(!fp) return errno == ENOENT ? 0 : -1;
+    if(!fgets(line, sizeof(line), fp) || sscanf(line, "# lsn %lu", &snap_lsn) != 1) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, "%49s %d %ld", name, &qty, &last) != 3) continue;
+        Fruit *f = add_fruit(name, qty);
+        if(!f) {
+            fclose(fp);
+            return -1;
+        }
+        atomic_store_explicit(&f->last_sold, (time_t)last, memory_order_relaxed);
+    }
+    fclose(fp);
+    last_lsn = snap_lsn;
+
+    fp = fopen(wal_path, "r");
+    if(!fp) return errno == ENOENT ? 1 : -1;
+    while(fgets(line, sizeof(line), fp)) {
+        if(!strchr(line, '\n')) break;  // torn tail
+        replay(line, snap_lsn);
+    }
+    fclose(fp);
+    return 1;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int sync_dir(void) {
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) return -1;
+    int r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+// Writes file via a temp file + rename, so a crash leaves the old or the new one
+static int replace_file(const char *path, const char *data, size_t len, int *keep_fd) {
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd < 0) return -1;
+    if(write_all(fd, data, len) < 0 || fsync(fd) < 0 || rename(tmp_path, path) < 0 || sync_dir() < 0) {
+        close(fd);
+        return -1;
+    }
+    if(keep_fd) *keep_fd = fd;
+    else close(fd);
+    return 0;
+}
+
+// Runs on the flusher thread (or before it starts), so nothing else writes
+// the log meanwhile: everything in the old log is covered by the snapshot,
+// and records still pending go to the new one.
+static int write_snapshot(void) {
+    TextBuf tb = {0};
+    int ok = 1;
+
+    pthread_rwlock_wrlock(&gate);
+    pthread_mutex_lock(&lock);
+    unsigned long lsn = last_lsn;
+    since_snapshot = 0;
+    pthread_mutex_unlock(&lock);
+    ok &= tb_printf(&tb, "# lsn %lu\n", lsn) == 0;
+    int n = fruit_count();
+    for(int i = 0; i < n; i++) {
+        Fruit *f = fruit_at(i);
+        ok &= tb_printf(&tb, "%s %d %ld\n", f->name, atomic_load(&f->qty),
+                        (long)atomic_load(&f->last_sold)) == 0;
+    }
+    pthread_rwlock_unlock(&gate);
+
+    int new_fd;
+    if(!ok || replace_file(snap_path, tb.data, tb.len, NULL) < 0 ||
+       replace_file(wal_path, "", 0, &new_fd) < 0) {
+        free(tb.data);
+        return -1;
+    }
+    free(tb.data);
+    if(wal_fd >= 0) close(wal_fd);
+    wal_fd = new_fd;
+    return 0;
+}
+
+static void* flusher(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while(1) {
+        while(pending.len == 0) pthread_cond_wait(&more, &lock);
+        TextBuf batch = pending;
+        pending = spare;
+        pending.len = 0;
+        unsigned long upto = last_lsn;
+        int due = since_snapshot >= SNAPSHOT_EVERY;
+        pthread_mutex_unlock(&lock);
+
+        // One write and one fdatasync for every purchase that queued meanwhile
+        if(write_all(wal_fd, batch.data, batch.len) < 0 || (sync_writes && fdatasync(wal_fd) < 0)) {
+            perror("Sales log write failed");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&lock);
+        spare = batch;
+        done_lsn = upto;
+        pthread_cond_broadcast(&flushed);
+        uint64_t one = 1;
+        for(int i = 0; i < nwatch; i++)
+            if(write(watch_fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) perror("Sales log eventfd write");
+
+        if(due) {
+            pthread_mutex_unlock(&lock);
+            if(write_snapshot() < 0) {
+                perror("Sales log snapshot failed");
+                exit(1);
+            }
+            pthread_mutex_lock(&lock);
+        }
+    }
+    return NULL;
+}
+
+int sales_log_start(const char *dir, int durable) {
+    pthread_rwlockattr_t attr;
+    pthread_t tid;
+
+    set_paths(dir);
+    if(mkdir(dir_path, 0755) < 0 && errno != EEXIST) return -1;
+    sync_writes = durable;
+    pthread_rwlockattr_init(&attr);
+    // Or a steady stream of buyers would keep the snapshot out forever
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&gate, &attr);
+
+    if(write_snapshot() < 0) return -1;
+    done_lsn = last_lsn;
+    running = 1;
+    if(pthread_create(&tid, NULL, flusher, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+// Caller holds gate shared
+static unsigned long append(const OrderLine *lines, int n) {
+    char rec[64 + MAX_ORDER_LINES * 64];
+    int len = snprintf(rec, sizeof(rec), " %ld %d", (long)time(NULL), n);
+    for(int i = 0; i < n && len < (int)sizeof(rec) - 64; i++)
+        len += snprintf(rec + len, sizeof(rec) - len, " %s %d", lines[i].fruit->name, lines[i].qty);
+    rec[len++] = '\n';
+
+    pthread_mutex_lock(&lock);
+    unsigned long lsn = ++last_lsn;
+    if(tb_printf(&pending, "%lu", lsn) < 0 || tb_append(&pending, rec, len) < 0) {
+        perror("Sales log append failed");
+        exit(1);
+    }
+    since_snapshot++;
+    pthread_cond_signal(&more);
+    pthread_mutex_unlock(&lock);
+    return lsn;
+}
+
+int sales_log_buy(Fruit *f, int qty, int *left, unsigned long *lsn) {
+    *lsn = 0;
+    if(!running) return buy_fruit(f, qty, left);
+
+    pthread_rwlock_rdlock(&gate);
+    int ok = buy_fruit(f, qty, left);
+    if(ok) {
+        OrderLine line = { f, qty };
+        *lsn = append(&line, 1);
+    }
+    pthread_rwlock_unlock(&gate);
+    return ok;
+}
+
+int sales_log_order(OrderLine *lines, int *n, int *short_line, int *left, unsigned long *lsn) {
+    *lsn = 0;
+    if(!running) return buy_order(lines, n, short_line, left);
+
+    pthread_rwlock_rdlock(&gate);
+    int ok = buy_order(lines, n, short_line, left);
+    if(ok) *lsn = append(lines, *n);
+    pthread_rwlock_unlock(&gate);
+    return ok;
+}
+
+void sales_log_wait(unsigned long lsn) {
+    if(!lsn) return;
+    pthread_mutex_lock(&lock);
+    while(done_lsn < lsn) pthread_cond_wait(&flushed, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+int sales_log_done(unsigned long lsn) {
+    return atomic_load(&done_lsn) >= lsn;
+}
+
+int sales_log_watch(int fd) {
+    pthread_mutex_lock(&lock);
+    int ok = nwatch < SALES_LOG_WATCHERS;
+    if(ok) watch_fds[nwatch++] = fd;
+    pthread_mutex_unlock(&lock);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,49 @@
+#ifndef SALES_LOG_H
+#define SALES_LOG_H
+
+// Write-ahead log of sales, so a store restarts with the stock it had.
+//
+// A state directory holds two text files:
+//   fruits.snap  "# lsn N" then "name qty last_sold" per fruit
+//   fruits.wal   "lsn time lines name qty [name qty ...]" per sale or order
+// Recovery loads the snapshot and replays the log records after its lsn;
+// a torn last line (no '\n') is a sale that was never acknowledged.
+//
+// Purchases append a record to an in-memory buffer and get its lsn back.
+// One flusher thread writes whatever has accumulated and fdatasyncs once
+// for the whole batch (group commit); callers that must not reply before
+// the sale is on disk pass the lsn to sales_log_wait(), or, on an event
+// loop that must not block, hold the reply until sales_log_done(). Every
+// SNAPSHOT_EVERY records the flusher writes a new snapshot and starts an
+// empty log.
+
+#include "fruit_catalog.h"
+
+#define SNAPSHOT_EVERY 100000
+#define SALES_LOG_WATCHERS 64
+
+// Load dir/fruits.snap and replay dir/fruits.wal into the (empty) catalog.
+// Returns 1 if state was restored, 0 if there was none (the caller seeds the
+// catalog as usual), -1 on error.
+int sales_log_restore(const char *dir);
+
+// Snapshot the current catalog, start an empty log and the flusher thread.
+// durable = 0 never fsyncs: a record counts as done once it is written to
+// the file, which survives a server crash but not an OS crash.
+int sales_log_start(const char *dir, int durable);
+
+// buy_fruit()/buy_order() plus the log record. *lsn is 0 if nothing was
+// bought or the log is not running.
+int sales_log_buy(Fruit *f, int qty, int *left, unsigned long *lsn);
+int sales_log_order(OrderLine *lines, int *n, int *short_line, int *left, unsigned long *lsn);
+
+// Block until every record up to lsn is done (written, and fdatasynced if
+// durable). sales_log_done() is the same test without blocking.
+void sales_log_wait(unsigned long lsn);
+int sales_log_done(unsigned long lsn);
+
+// The flusher writes 1 to fd (an eventfd) after every batch it finishes, so
+// an event loop can wake and release the replies it was holding
+int sales_log_watch(int fd);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "stock_snapshot.h"
+
+static void (*render_fn)(TextBuf *tb);
+static StockSnapshot *_Atomic current;
+static atomic_ulong version = 1;
+
+// Readers between loading `current` and taking their reference. A retired
+// snapshot may only be freed once this has been seen at zero after the swap,
+// otherwise a reader could still be about to bump its refcount.
+static atomic_int acquiring;
+
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static StockSnapshot *retired;   // guarded by render_lock
+
+int tb_printf(TextBuf *tb, const char *fmt, ...) {
+    va_list ap;
+    for(;;) {
+        size_t room = tb->cap - tb->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(tb->data ? tb->data + tb->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if(n < 0) return -1;
+        if((size_t)n < room) {
+            tb->len += n;
+            return 0;
+        }
+        size_t cap = tb->cap ? tb->cap * 2 : 4096;
+        while(cap - tb->len <= (size_t)n) cap *= 2;
+        char *p = realloc(tb->data, cap);
+        if(!p) return -1;
+        tb->data = p;
+        tb->cap = cap;
+    }
+}
+
+int tb_append(TextBuf *tb, const void *data, size_t len) {
+    if(tb->len + len > tb->cap) {
+        size_t cap = tb->cap ? tb->cap * 2 : 4096;
+        while(cap < tb->len + len) cap *= 2;
+        char *p = realloc(tb->data, cap);
+        if(!p) return -1;
+        tb->data = p;
+        tb->cap = cap;
+    }
+    if(len) memcpy(tb->data + tb->len, data, len);
+    tb->len += len;
+    return 0;
+}
+
+static StockSnapshot *render(unsigned long v) {
+    TextBuf tb = {0};
+    render_fn(&tb);
+
+    StockSnapshot *s = malloc(sizeof(StockSnapshot) + tb.len + 1);
+    if(!s) {
+        free(tb.data);
+        return NULL;
+    }
+    s->version = v;
+    atomic_init(&s->refs, 0);
+    s->next_retired = NULL;
+    s->len = tb.len;
+    if(tb.len) memcpy(s->text, tb.data, tb.len);
+    s->text[tb.len] = 0;
+    free(tb.data);
+    return s;
+}
+
+// Caller holds render_lock
+static void reclaim(void) {
+    if(atomic_load(&acquiring) != 0) return;
+    StockSnapshot **pp = &retired;
+    while(*pp) {
+        StockSnapshot *s = *pp;
+        if(atomic_load(&s->refs) == 0) {
+            *pp = s->next_retired;
+            free(s);
+        } else {
+            pp = &s->next_retired;
+        }
+    }
+}
+
+// Caller holds render_lock
+static void refresh(void) {
+    unsigned long v = atomic_load(&version);   // read first: changes made while rendering re-stale it
+    StockSnapshot *old = atomic_load(&current);
+    if(old && old->version == v) return;
+
+    StockSnapshot *s = render(v);
+    if(!s) return;   // keep serving the old text
+    atomic_store(&current, s);
+    if(old) {
+        old->next_retired = retired;
+        retired = old;
+    }
+    reclaim();
+}
+
+int snapshot_init(void (*render)(TextBuf *tb)) {
+    render_fn = render;
+    pthread_mutex_lock(&render_lock);
+    refresh();
+    pthread_mutex_unlock(&render_lock);
+    return atomic_load(&current) ? 0 : -1;
+}
+
+void snapshot_touch(void) {
+    atomic_fetch_add(&version, 1);
+}
+
+const StockSnapshot *snapshot_acquire(void) {
+    for(int tries = 0; ; tries++) {
+        atomic_fetch_add(&acquiring, 1);
+        StockSnapshot *s = atomic_load(&current);
+        atomic_fetch_add(&s->refs, 1);
+        atomic_fetch_sub(&acquiring, 1);
+
+        if(s->version == atomic_load(&version) || tries > 0) return s;
+
+        // Stale: one reader re-renders, everyone else serves the current text
+        if(pthread_mutex_trylock(&render_lock) != 0) return s;
+        refresh();
+        pthread_mutex_unlock(&render_lock);
+        snapshot_release(s);
+    }
+}
+
+void snapshot_release(const StockSnapshot *s) {
+    atomic_fetch_sub(&((StockSnapshot *)s)->refs, 1);
+}
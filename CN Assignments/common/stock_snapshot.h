@@ -0,0 +1,38 @@
+#ifndef STOCK_SNAPSHOT_H
+#define STOCK_SNAPSHOT_H
+
+// Pre-rendered "Current Stock" / "Customer List" text, shared by every reader.
+//
+// Writers call snapshot_touch() when a purchase or a new customer changes
+// what the listing would show. Readers take the current buffer with
+// snapshot_acquire() without locking; the first reader to notice a stale
+// version re-renders it once and swaps the pointer in, RCU style. Old
+// buffers are freed once no reader holds them.
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} TextBuf;
+
+// Append to tb, growing it as needed. Return -1 if out of memory.
+int tb_printf(TextBuf *tb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int tb_append(TextBuf *tb, const void *data, size_t len);
+
+typedef struct StockSnapshot {
+    unsigned long version;
+    atomic_int refs;
+    struct StockSnapshot *next_retired;
+    size_t len;
+    char text[];
+} StockSnapshot;
+
+int snapshot_init(void (*render)(TextBuf *tb));   // -1 if the first render fails
+void snapshot_touch(void);
+
+const StockSnapshot *snapshot_acquire(void);
+void snapshot_release(const StockSnapshot *s);
+
+#endif